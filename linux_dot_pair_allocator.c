@@ -1,8 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/mempolicy.h>
 #include <unistd.h>
-#include <fcntl.h>
 
 struct pair
 {
@@ -14,68 +21,1911 @@ struct pair
 #define PAGE_SIZE sysconf(_SC_PAGE_SIZE)
 #define PAIRS_PER_PAGE PAGE_SIZE / PAIR_SIZE
 
-// Linked list for keeping free blocks of memory
+// Heap is one big reserved block of address space, slabs are committed from it when needed
+// Because slabs are laid out one after another, a pointer can be turned into its slab
+// and its slot inside the slab with plain arithmetic
 
-struct pair * pairPool = NULL;
-struct pair * pairPoolHead = NULL;
+#define SLAB_SIZE (64 * 1024)
+#define PAIRS_PER_SLAB (SLAB_SIZE / PAIR_SIZE)
+#define SLAB_BITMAP_WORDS (PAIRS_PER_SLAB / 64)
+#define HEAP_RESERVE ((size_t)1 << 34)
 
+// Build with -DLALLOC_DEBUG to poison freed pairs, catch double and foreign frees
+// and get a list of leaked pairs when the program exits
+
+#define LALLOC_POISON ((void *)0xdeadbeefdeadbeefULL)
+#define LEAK_REPORT_MAX 16
+
+// Side information for every slab, kept outside of the heap so the pairs stay 16 bytes
+// usedBits has a bit set for every allocated pair, markBits is used by the collector
+
+struct slab
+{
+    uint64_t markBits[SLAB_BITMAP_WORDS];
+    uint64_t usedBits[SLAB_BITMAP_WORDS];
+    unsigned int sweepPending;
+    unsigned int fromSpace;
+    unsigned int node;
+};
+
+// Every NUMA node has its own pool with a lock, a free list and a bump region
+// A slab belongs to one node, its pairs are only handed out and taken back under that node's lock
+// Threads allocate from the pool of the node they run on
+
+#define MAX_NUMA_NODES 16
+#define NODE_RECHECK_INTERVAL 1024
+#define REMOTE_FREE_BATCH 64
+
+struct nodePool
+{
+    pthread_mutex_t lock;
+
+    // Linked list for keeping free blocks of memory
+    struct pair * freeHead;
+
+    // Untouched rest of the newest slab, pairs are handed out from it in address order
+    struct pair * bumpNext;
+    struct pair * bumpEnd;
+    size_t bumpSlab;
+
+    size_t sweepCursor;
+
+    size_t live;
+    size_t peak;
+    size_t allocs;
+    size_t frees;
+} __attribute__((aligned(64)));
+
+struct nodePool nodePools[MAX_NUMA_NODES];
+unsigned int numaNodeCount = 1;
+
+// Pairs freed by a thread running on another node than the one owning them are collected
+// per owner and handed over in one go, so the owner's lock and list are touched once per batch
+// Batches only hold pointers, the pairs themselves are not written until the owner's lock is held,
+// a collector sweeping them meanwhile cannot be disturbed
+
+struct remoteBatch
+{
+    struct pair * pairs[REMOTE_FREE_BATCH];
+    size_t count;
+    unsigned long epoch;
+};
+
+__thread struct remoteBatch remoteBatches[MAX_NUMA_NODES];
+__thread int cachedNode = 0;
+__thread unsigned int nodeRecheckCountdown = 0;
+
+pthread_key_t remoteBatchKey;
+
+char * heapBase = NULL;
+size_t heapReserved = 0;
+
+// Slab headers are mapped for the whole reservation up front, so they never move
+// and can be used under a node lock while another thread grows the heap
+
+struct slab * slabs = NULL;
+size_t slabCount = 0;
+
+// Slabs given back to the system by compaction, reused before new ones are committed
+
+size_t * releasedSlabs = NULL;
+size_t releasedSlabCount = 0;
+
+pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
 unsigned int pairPoolInitialized = 0;
 
-// Function maps memory and initializes linked list
-// I used a singly linked list because I found it simpler
-// Hopefully this is correct
+// Garbage collector state, roots are addresses of variables holding pairs
+// gcEpoch changes whenever a collection or compaction may have reclaimed pairs
+
+struct pair *** gcRoots = NULL;
+size_t gcRootCount = 0;
+size_t gcRootCapacity = 0;
+
+struct pair ** markStack = NULL;
+size_t markStackLen = 0;
+size_t markStackCapacity = 0;
+
+unsigned int gcEnabled = 0;
+unsigned long gcEpoch = 0;
+
+// Counters for sizing pools, live pairs include garbage not yet found by the collector
+// Counters are kept per node, each node's peak is raised with every allocation and the reported peak
+// adds them up, which is exact with one node and never below the real peak with more
+
+struct lallocStats
+{
+    size_t live;
+    size_t peak;
+    size_t allocs;
+    size_t frees;
+    size_t slabs;
+    size_t releasedSlabs;
+    double allocsPerSec;
+};
+
+struct timespec poolStartTime;
+
+// Heap lock, taken for growing the heap, collection, compaction and compact pairs
+// Slow paths take it first and then every node lock in node order
+
+pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+void freePairs(struct pair * p, size_t n);
+void lflushRemoteFrees();
+
+// Returns the slab a heap pointer belongs to and the slot of the pair in it
+
+struct slab * pairSlab(void * p, size_t * slot)
+{
+    size_t offset = (char *)p - heapBase;
+
+    *slot = (offset % SLAB_SIZE) / PAIR_SIZE;
+
+    return &slabs[offset / SLAB_SIZE];
+}
+
+int testBit(uint64_t * bitmap, size_t slot)
+{
+    return (bitmap[slot / 64] >> (slot % 64)) & 1;
+}
+
+void setBit(uint64_t * bitmap, size_t slot)
+{
+    bitmap[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+void clearBit(uint64_t * bitmap, size_t slot)
+{
+    bitmap[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+}
+
+// Clears ar of a pair going to the free list, debug builds fill it with a recognizable value
+
+void poisonPair(struct pair * p)
+{
+#ifdef LALLOC_DEBUG
+    p->ar = LALLOC_POISON;
+#else
+    p->ar = NULL;
+#endif
+}
+
+// Checks if p points at an allocated pair of the heap
+// Anything else stored in ar or dr (numbers, strings, ...) is ignored by the collector
+
+int isHeapPair(void * p)
+{
+    char * addr = p;
+    size_t slot;
+
+    if(addr < heapBase || addr >= heapBase + slabCount * SLAB_SIZE)
+        return 0;
+
+    if((addr - heapBase) % PAIR_SIZE != 0)
+        return 0;
+
+    struct slab * s = pairSlab(p, &slot);
+
+    return testBit(s->usedBits, slot);
+}
+
+size_t totalLive()
+{
+    size_t live = 0;
+
+    for(unsigned int i = 0; i < numaNodeCount; i++)
+        live += nodePools[i].live;
+
+    return live;
+}
+
+void lockPools()
+{
+    pthread_mutex_lock(&poolLock);
+
+    for(unsigned int i = 0; i < numaNodeCount; i++)
+        pthread_mutex_lock(&nodePools[i].lock);
+}
+
+void unlockPools()
+{
+    for(unsigned int i = numaNodeCount; i > 0; i--)
+        pthread_mutex_unlock(&nodePools[i - 1].lock);
+
+    pthread_mutex_unlock(&poolLock);
+}
+
+// Reads number of NUMA nodes from sysfs, the file looks like "0-1" or "0"
+// Machines without NUMA or without sysfs get a single node
 
-void memPoolInit()
+unsigned int detectNumaNodes()
 {
-    int fd = open("/dev/zero", O_RDWR);
+    unsigned int first = 0, last = 0;
+    FILE * online = fopen("/sys/devices/system/node/online", "r");
+
+    if(online == NULL)
+        return 1;
+
+    int found = fscanf(online, "%u-%u", &first, &last);
 
-    pairPool = mmap(0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    
-    close(fd);
+    fclose(online);
 
-    pairPoolHead = pairPool;
+    if(found < 1)
+        return 1;
 
-    for(int i = 0; i < PAIRS_PER_PAGE - 1; i++)
+    if(found == 1)
+        last = first;
+
+    return last + 1 > MAX_NUMA_NODES ? MAX_NUMA_NODES : last + 1;
+}
+
+// Node of the CPU the calling thread runs on, only asked for every few calls
+// because threads rarely migrate and getcpu is a real system call here
+
+int currentNode()
+{
+    if(numaNodeCount == 1)
+        return 0;
+
+    if(nodeRecheckCountdown-- == 0)
     {
-        pairPool[i].ar = i;
-        pairPool[i].dr = &pairPool[i + 1]; 
+        unsigned int cpu, node;
+
+        if(syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < numaNodeCount)
+            cachedNode = node;
+        else
+            cachedNode = 0;
+
+        nodeRecheckCountdown = NODE_RECHECK_INTERVAL;
     }
 
-    pairPool[PAIRS_PER_PAGE - 1].ar = PAIRS_PER_PAGE - 1;
-    pairPool[PAIRS_PER_PAGE - 1].dr = NULL;
+    return cachedNode;
 }
 
-struct pair * lalloc()
+// Asks the kernel to place pages of a slab on a node, MPOL_PREFERRED falls back to
+// other nodes instead of failing when the node is out of memory
+
+void bindSlabToNode(void * slabStart, unsigned int node)
 {
-    // If lalloc is called for the first time initializes linked list
-    if(! pairPoolInitialized)
+    unsigned long nodeMask = 1UL << node;
+
+    if(numaNodeCount == 1)
+        return;
+
+    syscall(SYS_mbind, slabStart, SLAB_SIZE, MPOL_PREFERRED, &nodeMask, numaNodeCount + 1, 0);
+}
+
+// Function reserves address space for the heap and its slab headers, nothing is committed yet
+// If the full reservation is refused it retries with smaller sizes
+
+int memPoolInit()
+{
+    size_t reserve = HEAP_RESERVE;
+
+    while(reserve >= SLAB_SIZE)
     {
-        memPoolInit();
+        heapBase = mmap(0, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if(heapBase != MAP_FAILED)
+        {
+            heapReserved = reserve;
+
+            break;
+        }
 
-        pairPoolInitialized = 1;
+        reserve /= 2;
     }
 
-    // No free memory blocks are availible
+    if(heapBase == MAP_FAILED || heapReserved == 0)
+    {
+        heapBase = NULL;
 
-    if(pairPoolHead == NULL)
-        return NULL;
+        return 1;
+    }
 
-    struct pair * allocatedPair = pairPoolHead;
-    pairPoolHead = pairPoolHead->dr;
+    size_t maxSlabs = heapReserved / SLAB_SIZE;
 
-    return allocatedPair;
+    slabs = mmap(0, maxSlabs * sizeof(struct slab), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    releasedSlabs = malloc(maxSlabs * sizeof(size_t));
+
+    if(slabs == MAP_FAILED || releasedSlabs == NULL)
+        return 1;
+
+    return 0;
 }
 
-void lfree(struct pair * p)
+// Commits next slab of the heap and makes it the new bump region of a node
+// Slabs released by compaction are taken first, then the reservation is extended
+// Whatever was left of the old bump region goes to the node's free list
+
+int memPoolGrow(struct nodePool * pool)
 {
-    // Makes pointer p a new head of linked list
-    struct pair * prevHead = pairPoolHead;
+    size_t index;
+    unsigned int node = pool - nodePools;
+
+    if(releasedSlabCount > 0)
+        index = releasedSlabs[--releasedSlabCount];
+    else
+    {
+        if((slabCount + 1) * SLAB_SIZE > heapReserved)
+            return 1;
+
+        if(mprotect(heapBase + slabCount * SLAB_SIZE, SLAB_SIZE, PROT_READ | PROT_WRITE))
+            return 1;
+
+        index = slabCount;
+    }
+
+    struct pair * slabPairs = (struct pair *)(heapBase + index * SLAB_SIZE);
+
+    memset(&slabs[index], 0, sizeof(struct slab));
+    slabs[index].node = node;
+
+    bindSlabToNode(slabPairs, node);
+
+    while(pool->bumpEnd > pool->bumpNext)
+    {
+        pool->bumpEnd--;
+        poisonPair(pool->bumpEnd);
+        pool->bumpEnd->dr = pool->freeHead;
+        pool->freeHead = pool->bumpEnd;
+    }
+
+    pool->bumpNext = slabPairs;
+    pool->bumpEnd = slabPairs + PAIRS_PER_SLAB;
+    pool->bumpSlab = index;
+
+    if(index == slabCount)
+        __atomic_store_n(&slabCount, slabCount + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// Returns every allocated but unmarked pair of a slab to its node's free list
+// Returns number of reclaimed pairs
 
-    pairPoolHead = p;
-    pairPoolHead->dr = prevHead;
+size_t sweepSlab(size_t index)
+{
+    struct slab * s = &slabs[index];
+    struct pair * slabPairs = (struct pair *)(heapBase + index * SLAB_SIZE);
+    struct nodePool * pool = &nodePools[s->node];
+    size_t freed = 0;
+
+    if(! s->sweepPending)
+        return 0;
+
+    for(size_t w = 0; w < SLAB_BITMAP_WORDS; w++)
+    {
+        uint64_t garbage = s->usedBits[w] & ~s->markBits[w];
+
+        while(garbage)
+        {
+            struct pair * p = &slabPairs[w * 64 + __builtin_ctzll(garbage)];
+
+            poisonPair(p);
+            p->dr = pool->freeHead;
+            pool->freeHead = p;
+
+            garbage &= garbage - 1;
+            freed++;
+        }
+
+        s->usedBits[w] &= s->markBits[w];
+        s->markBits[w] = 0;
+    }
+
+    s->sweepPending = 0;
+
+    pool->live -= freed;
+    pool->frees += freed;
+
+    return freed;
+}
+
+// Sweeps the node's slabs left over from the last collection until some pairs are reclaimed
+// This way the sweep work is spread over lalloc calls instead of one long pause
+
+int lazySweep(struct nodePool * pool)
+{
+    unsigned int node = pool - nodePools;
+    size_t committed = __atomic_load_n(&slabCount, __ATOMIC_ACQUIRE);
+
+    while(pool->sweepCursor < committed)
+    {
+        size_t index = pool->sweepCursor++;
+
+        if(slabs[index].node == node && sweepSlab(index) > 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+void markPush(void * p)
+{
+    size_t slot;
+
+    if(! isHeapPair(p))
+        return;
+
+    struct slab * s = pairSlab(p, &slot);
+
+    if(testBit(s->markBits, slot))
+        return;
+
+    setBit(s->markBits, slot);
+
+    if(markStackLen == markStackCapacity)
+    {
+        size_t newCapacity = markStackCapacity ? markStackCapacity * 2 : 1024;
+        struct pair ** newStack = realloc(markStack, newCapacity * sizeof(struct pair *));
+
+        if(newStack == NULL)
+        {
+            printf("Out of memory while marking pairs\n");
+
+            exit(1);
+        }
+
+        markStack = newStack;
+        markStackCapacity = newCapacity;
+    }
+
+    markStack[markStackLen++] = p;
+}
+
+// Registers address of a variable that holds a pair, everything reachable from it survives collection
+
+int lgcAddRoot(struct pair ** root)
+{
+    pthread_mutex_lock(&poolLock);
+
+    if(gcRootCount == gcRootCapacity)
+    {
+        size_t newCapacity = gcRootCapacity ? gcRootCapacity * 2 : 16;
+        struct pair *** newRoots = realloc(gcRoots, newCapacity * sizeof(struct pair **));
+
+        if(newRoots == NULL)
+        {
+            pthread_mutex_unlock(&poolLock);
+
+            return 1;
+        }
+
+        gcRoots = newRoots;
+        gcRootCapacity = newCapacity;
+    }
+
+    gcRoots[gcRootCount++] = root;
+
+    pthread_mutex_unlock(&poolLock);
+
+    return 0;
+}
+
+void lgcRemoveRoot(struct pair ** root)
+{
+    pthread_mutex_lock(&poolLock);
+
+    for(size_t i = 0; i < gcRootCount; i++)
+    {
+        if(gcRoots[i] == root)
+        {
+            gcRoots[i] = gcRoots[--gcRootCount];
+
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&poolLock);
+}
+
+// Turns automatic collection in lalloc on or off, lfree keeps working either way
+
+void lgcEnable(int enable)
+{
+    pthread_mutex_lock(&poolLock);
+
+    gcEnabled = enable;
+
+    pthread_mutex_unlock(&poolLock);
 }
 
-int main()
+// Marks every pair reachable from roots through ar and dr
+// Sweeping is only scheduled here, lalloc does it slab by slab later
+// Pairs sitting in remote free batches are unreachable garbage, so they get swept
+// and the batches are dropped by bumping the epoch, batches never write into the pairs
+// before their flush, so the sweep owns them
+// Returns number of live pairs
+
+size_t markLive()
+{
+    size_t live = 0;
+
+    // Mark bits of slabs not yet swept still belong to the previous collection
+
+    for(size_t i = 0; i < slabCount; i++)
+        sweepSlab(i);
+
+    for(size_t i = 0; i < gcRootCount; i++)
+        markPush(*gcRoots[i]);
+
+    while(markStackLen > 0)
+    {
+        struct pair * p = markStack[--markStackLen];
+
+        markPush(p->ar);
+        markPush(p->dr);
+
+        live++;
+    }
+
+    __atomic_store_n(&gcEpoch, gcEpoch + 1, __ATOMIC_RELAXED);
+
+    return live;
+}
+
+size_t collectPairs()
+{
+    size_t live = markLive();
+
+    for(size_t i = 0; i < slabCount; i++)
+        slabs[i].sweepPending = 1;
+
+    for(unsigned int i = 0; i < numaNodeCount; i++)
+        nodePools[i].sweepCursor = 0;
+
+    return live;
+}
+
+// Compaction copies live pairs into fresh slabs Cheney style
+// Mark bit of a pair in from space means it was already copied, its ar then holds the new address
+// Copies stay on the node of the original, so every node has its own to space bump region
+
+struct compactState
+{
+    size_t * toSlabs;
+    size_t * scanned;
+    size_t toSlabCount;
+};
+
+struct pair * compactAlloc(struct compactState * state, unsigned int node)
+{
+    struct nodePool * pool = &nodePools[node];
+
+    if(pool->bumpNext == pool->bumpEnd)
+    {
+        // compactPairs committed enough slabs up front, failing here means that count was wrong
+        // and the from space is already half forwarded, so there is nothing left to return to
+        if(memPoolGrow(pool))
+        {
+            printf("Out of address space while compacting pairs\n");
+
+            exit(1);
+        }
+
+        size_t * newToSlabs = realloc(state->toSlabs, (state->toSlabCount + 1) * sizeof(size_t));
+        size_t * newScanned = newToSlabs ? realloc(state->scanned, (state->toSlabCount + 1) * sizeof(size_t)) : NULL;
+
+        if(newToSlabs == NULL || newScanned == NULL)
+        {
+            printf("Out of memory while compacting pairs\n");
+
+            exit(1);
+        }
+
+        state->toSlabs = newToSlabs;
+        state->scanned = newScanned;
+        state->toSlabs[state->toSlabCount] = pool->bumpSlab;
+        state->scanned[state->toSlabCount] = 0;
+        state->toSlabCount++;
+    }
+
+    struct pair * p = pool->bumpNext++;
+    size_t slot;
+    struct slab * s = pairSlab(p, &slot);
+
+    setBit(s->usedBits, slot);
+    pool->live++;
+
+    return p;
+}
+
+int isFromSpace(void * p)
+{
+    size_t slot;
+
+    if(! isHeapPair(p))
+        return 0;
+
+    struct slab * s = pairSlab(p, &slot);
+
+    return s->fromSpace;
+}
+
+// Returns new address of a pair, copying it first if needed
+// A copied pair drags the rest of its dr chain along, so lists end up in consecutive cells
+
+void * forwardPair(void * p, struct compactState * state)
+{
+    size_t slot;
+    struct pair * q = p;
+
+    if(! isFromSpace(p))
+        return p;
+
+    while(isFromSpace(q))
+    {
+        struct slab * s = pairSlab(q, &slot);
+
+        if(testBit(s->markBits, slot))
+            break;
+
+        struct pair * copy = compactAlloc(state, s->node);
+
+        // Growing the heap may have moved slab headers, so look the slab up again
+        s = pairSlab(q, &slot);
+
+        *copy = *q;
+
+        setBit(s->markBits, slot);
+        q->ar = copy;
+
+        q = copy->dr;
+    }
+
+    return ((struct pair *)p)->ar;
+}
+
+// Number of pairs copied into a to space slab so far
+
+size_t toSlabFill(size_t index)
 {
+    struct nodePool * pool = &nodePools[slabs[index].node];
+
+    if(pool->bumpSlab == index)
+        return pool->bumpNext - (struct pair *)(heapBase + index * SLAB_SIZE);
+
+    return PAIRS_PER_SLAB;
+}
+
+// Moves all pairs reachable from roots next to each other and gives emptied slabs back to the system
+// Every live pair has to be reachable from registered roots, the same rule the collector has
+// Pointers into the heap held anywhere else become dangling
+// Returns 1 if there is not enough free address space for the copy
+
+int compactPairs()
+{
+    struct compactState state = { NULL, NULL, 0 };
+
+    if(! pairPoolInitialized)
+        return 0;
+
+    size_t live = markLive();
+    size_t spareSlabs = heapReserved / SLAB_SIZE - slabCount + releasedSlabCount;
+
+    size_t neededSlabs = live / PAIRS_PER_SLAB + numaNodeCount;
+
+    if(neededSlabs > spareSlabs)
+        return 1;
+
+    // Commit every slab the copy may take before touching anything, compactAlloc cannot fail
+    // after forwarding started since from space pairs then hold forwarding addresses
+    if(neededSlabs > releasedSlabCount)
+    {
+        size_t newSlabs = neededSlabs - releasedSlabCount;
+
+        if(mprotect(heapBase + slabCount * SLAB_SIZE, newSlabs * SLAB_SIZE, PROT_READ | PROT_WRITE))
+            return 1;
+    }
+
+    for(size_t i = 0; i < slabCount; i++)
+    {
+        memset(slabs[i].markBits, 0, sizeof(slabs[i].markBits));
+
+        slabs[i].fromSpace = 1;
+    }
+
+    for(size_t i = 0; i < releasedSlabCount; i++)
+        slabs[releasedSlabs[i]].fromSpace = 0;
+
+    // Free lists and bump regions all lie in from space, live pairs are counted again while copying
+
+    for(unsigned int i = 0; i < numaNodeCount; i++)
+    {
+        nodePools[i].frees += nodePools[i].live;
+        nodePools[i].live = 0;
+        nodePools[i].freeHead = NULL;
+        nodePools[i].bumpNext = NULL;
+        nodePools[i].bumpEnd = NULL;
+    }
+
+    for(size_t i = 0; i < gcRootCount; i++)
+        *gcRoots[i] = forwardPair(*gcRoots[i], &state);
+
+    // Scan copied pairs and forward their fields until no slab has unscanned pairs left
+    // With one bump region per node a slab can get new pairs after it was scanned
+
+    int progress = 1;
+
+    while(progress)
+    {
+        progress = 0;
+
+        for(size_t t = 0; t < state.toSlabCount; t++)
+        {
+            struct pair * slabPairs = (struct pair *)(heapBase + state.toSlabs[t] * SLAB_SIZE);
+
+            while(state.scanned[t] < toSlabFill(state.toSlabs[t]))
+            {
+                struct pair * p = &slabPairs[state.scanned[t]++];
+
+                p->ar = forwardPair(p->ar, &state);
+                p->dr = forwardPair(p->dr, &state);
+
+                progress = 1;
+            }
+        }
+    }
+
+    for(size_t i = 0; i < slabCount; i++)
+    {
+        if(! slabs[i].fromSpace)
+            continue;
+
+        madvise(heapBase + i * SLAB_SIZE, SLAB_SIZE, MADV_DONTNEED);
+        memset(&slabs[i], 0, sizeof(struct slab));
+
+        releasedSlabs[releasedSlabCount++] = i;
+    }
+
+    for(unsigned int i = 0; i < numaNodeCount; i++)
+    {
+        nodePools[i].sweepCursor = slabCount;
+        nodePools[i].frees -= nodePools[i].live;
+    }
+
+    free(state.toSlabs);
+    free(state.scanned);
+
+    return 0;
+}
+
+// Sets used bit of a newly allocated pair and clears its fields
+
+void markAllocated(struct nodePool * pool, struct pair * p)
+{
+    size_t slot;
+    struct slab * s = pairSlab(p, &slot);
+
+    setBit(s->usedBits, slot);
+
+    // Pairs allocated in a slab that still waits for sweeping count as marked
+    if(s->sweepPending)
+        setBit(s->markBits, slot);
+
+    p->ar = NULL;
+    p->dr = NULL;
+
+    pool->allocs++;
+    pool->live++;
+
+    if(pool->live > pool->peak)
+        pool->peak = pool->live;
+}
+
+// Takes a pair from a node's free list, sweeping more of the node's slabs if it is empty
+
+struct pair * popFreePair(struct nodePool * pool)
+{
+    if(pool->freeHead == NULL && ! lazySweep(pool))
+        return NULL;
+
+    struct pair * p = pool->freeHead;
+    pool->freeHead = p->dr;
+
+#ifdef LALLOC_DEBUG
+    if(p->ar != LALLOC_POISON)
+    {
+        fprintf(stderr, "lalloc: pair %p was written to after it was freed\n", (void *)p);
+
+        abort();
+    }
+#endif
+
+    return p;
+}
+
+// Checks a pair passed to lfree and finds the node owning it
+
+struct nodePool * pairOwner(struct pair * p)
+{
+    size_t slot;
+
+#ifdef LALLOC_DEBUG
+    char * addr = (char *)p;
+    size_t committed = __atomic_load_n(&slabCount, __ATOMIC_ACQUIRE);
+
+    if(addr < heapBase || addr >= heapBase + committed * SLAB_SIZE || (addr - heapBase) % PAIR_SIZE != 0)
+    {
+        fprintf(stderr, "lfree: %p was not allocated by lalloc\n", (void *)p);
+
+        abort();
+    }
+#endif
+
+    return &nodePools[pairSlab(p, &slot)->node];
+}
+
+// Takes a pair out of the used bitmap, the owning node's lock has to be held
+
+void releasePair(struct nodePool * pool, struct pair * p)
+{
+    size_t slot;
+    struct slab * s = pairSlab(p, &slot);
+
+#ifdef LALLOC_DEBUG
+    if(! testBit(s->usedBits, slot))
+    {
+        fprintf(stderr, "lfree: double free of pair %p\n", (void *)p);
+
+        abort();
+    }
+#endif
+
+    clearBit(s->usedBits, slot);
+    clearBit(s->markBits, slot);
+
+    poisonPair(p);
+
+    pool->live--;
+    pool->frees++;
+}
+
+void lallocGetStats(struct lallocStats * stats)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    memset(stats, 0, sizeof(struct lallocStats));
+
+    lockPools();
+
+    double elapsed = (now.tv_sec - poolStartTime.tv_sec) + (now.tv_nsec - poolStartTime.tv_nsec) / 1e9;
+
+    for(unsigned int i = 0; i < numaNodeCount; i++)
+    {
+        stats->live += nodePools[i].live;
+        stats->peak += nodePools[i].peak;
+        stats->allocs += nodePools[i].allocs;
+        stats->frees += nodePools[i].frees;
+    }
+
+    stats->slabs = slabCount - releasedSlabCount;
+    stats->releasedSlabs = releasedSlabCount;
+    stats->allocsPerSec = pairPoolInitialized && elapsed > 0 ? stats->allocs / elapsed : 0;
+
+    unlockPools();
+}
+
+void lallocPrintStats()
+{
+    struct lallocStats stats;
+
+    lallocGetStats(&stats);
+
+    printf("pairs live: %zu, peak: %zu, allocs: %zu, frees: %zu, allocs/s: %.0f\n",
+        stats.live, stats.peak, stats.allocs, stats.frees, stats.allocsPerSec);
+    printf("slabs in use: %zu (%zu kB), released: %zu, NUMA nodes: %u\n",
+        stats.slabs, stats.slabs * SLAB_SIZE / 1024, stats.releasedSlabs, numaNodeCount);
+}
+
+// Lists pairs that were never freed, registered with atexit in debug builds
+// With the collector on, unreachable pairs not swept yet show up here as well
+
+void lallocLeakReport()
+{
+    size_t reported = 0;
+
+    lflushRemoteFrees();
+
+    size_t live = totalLive();
+
+    if(live == 0)
+        return;
+
+    printf("lalloc: %zu pairs were not freed\n", live);
+
+    for(size_t i = 0; i < slabCount && reported < LEAK_REPORT_MAX; i++)
+    {
+        struct pair * slabPairs = (struct pair *)(heapBase + i * SLAB_SIZE);
+
+        for(size_t slot = 0; slot < PAIRS_PER_SLAB && reported < LEAK_REPORT_MAX; slot++)
+        {
+            if(! testBit(slabs[i].usedBits, slot))
+                continue;
+
+            printf("    %p ar: %p dr: %p\n", (void *)&slabPairs[slot], slabPairs[slot].ar, slabPairs[slot].dr);
+
+            reported++;
+        }
+    }
+
+    if(live > reported)
+        printf("    ...\n");
+}
+
+void remoteBatchDestructor(void * unused)
+{
+    (void)unused;
+
+    lflushRemoteFrees();
+}
+
+void poolInitOnce()
+{
+    if(memPoolInit())
+        return;
+
+    numaNodeCount = detectNumaNodes();
+
+    for(unsigned int i = 0; i < numaNodeCount; i++)
+        pthread_mutex_init(&nodePools[i].lock, NULL);
+
+    pthread_key_create(&remoteBatchKey, remoteBatchDestructor);
+
+    clock_gettime(CLOCK_MONOTONIC, &poolStartTime);
+
+#ifdef LALLOC_DEBUG
+    atexit(lallocLeakReport);
+#endif
+
+    // Key destructors do not run for the main thread returning from main
+
+    atexit(lflushRemoteFrees);
+
+    __atomic_store_n(&pairPoolInitialized, 1, __ATOMIC_RELEASE);
+}
+
+int lpoolInit()
+{
+    // If the allocator is used for the first time reserves the heap
+    pthread_once(&poolOnce, poolInitOnce);
+
+    return ! __atomic_load_n(&pairPoolInitialized, __ATOMIC_ACQUIRE);
+}
+
+// Fast path, only the node's own lock is held
+
+struct pair * allocFromNode(struct nodePool * pool)
+{
+    struct pair * allocatedPair = NULL;
+
+    if(pool->freeHead != NULL)
+        allocatedPair = popFreePair(pool);
+    else if(pool->bumpNext < pool->bumpEnd)
+        allocatedPair = pool->bumpNext++;
+    else
+        allocatedPair = popFreePair(pool);
+
+    if(allocatedPair != NULL)
+        markAllocated(pool, allocatedPair);
+
+    return allocatedPair;
+}
+
+// Slow path, called with every lock held when a node ran out of pairs
+// First collects, and maps a new slab only if that was not enough
+// If most of the heap survived a collection the heap grows right away to avoid collecting again soon
+// If the heap can not grow any more, pairs of other nodes are used
+
+struct pair * refillAndAlloc(struct nodePool * pool)
+{
+    struct pair * p = allocFromNode(pool);
+
+    if(p != NULL)
+        return p;
+
+    if(gcEnabled)
+    {
+        size_t live = collectPairs();
+
+        if(live * 4 < (slabCount - releasedSlabCount) * PAIRS_PER_SLAB * 3 && (p = allocFromNode(pool)) != NULL)
+            return p;
+    }
+
+    if(! memPoolGrow(pool))
+        return allocFromNode(pool);
+
+    for(unsigned int i = 0; i < numaNodeCount && p == NULL; i++)
+        p = allocFromNode(&nodePools[i]);
+
+    // No free memory blocks are availible
+
+    return p;
+}
+
+void freePair(struct nodePool * pool, struct pair * p)
+{
+    releasePair(pool, p);
+
+    // Makes pointer p a new head of linked list
+    struct pair * prevHead = pool->freeHead;
+
+    pool->freeHead = p;
+    pool->freeHead->dr = prevHead;
+}
+
+// Hands a batch of pairs freed on another node to their owner
+// Batch started before the last collection is dropped, the collector already reclaimed those pairs
+// or compaction released their slabs, pairs a lazy sweep got to first are skipped
+
+void flushRemoteBatch(unsigned int node)
+{
+    struct remoteBatch * batch = &remoteBatches[node];
+    struct nodePool * pool = &nodePools[node];
+
+    if(batch->count == 0)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if(batch->epoch == gcEpoch)
+    {
+        for(size_t i = 0; i < batch->count; i++)
+        {
+            size_t slot;
+            struct slab * s = pairSlab(batch->pairs[i], &slot);
+
+            if(testBit(s->usedBits, slot))
+                freePair(pool, batch->pairs[i]);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    batch->count = 0;
+}
+
+// Sends all remote frees of the calling thread to their owners, threads do it on exit by themselves
+
+void lflushRemoteFrees()
+{
+    if(! pairPoolInitialized)
+        return;
+
+    for(unsigned int i = 0; i < numaNodeCount; i++)
+        flushRemoteBatch(i);
+}
+
+void queueRemoteFree(unsigned int node, struct pair * p)
+{
+    struct remoteBatch * batch = &remoteBatches[node];
+    unsigned long epoch = __atomic_load_n(&gcEpoch, __ATOMIC_RELAXED);
+
+    if(batch->count > 0 && batch->epoch != epoch)
+        flushRemoteBatch(node);
+
+    if(batch->count == 0)
+    {
+        batch->epoch = epoch;
+
+        pthread_setspecific(remoteBatchKey, batch);
+    }
+
+    batch->pairs[batch->count++] = p;
+
+    if(batch->count == REMOTE_FREE_BATCH)
+        flushRemoteBatch(node);
+}
+
+// Allocates n pairs already linked through dr like a list, last dr is NULL
+// Pairs are cut from the node's bump region in one run, so the list lies in sequential memory
+// A run that does not fit into the rest of the slab starts a fresh one, longer runs
+// continue into the next slab, which lies right behind the current one unless it was
+// a slab released by compaction
+// When the heap reservation is used up the remaining pairs come from the free list
+// Returns NULL if not all n pairs could be allocated
+
+struct pair * allocPairs(struct nodePool * pool, size_t n)
+{
+    struct pair * first = NULL;
+    struct pair ** link = &first;
+    size_t allocated = 0;
+
+    if((size_t)(pool->bumpEnd - pool->bumpNext) < n && n <= PAIRS_PER_SLAB)
+        memPoolGrow(pool);
+
+    while(allocated < n)
+    {
+        if(pool->bumpNext == pool->bumpEnd && memPoolGrow(pool))
+            break;
+
+        size_t run = pool->bumpEnd - pool->bumpNext;
+
+        if(run > n - allocated)
+            run = n - allocated;
+
+        struct pair * runPairs = pool->bumpNext;
+        pool->bumpNext += run;
+
+        for(size_t i = 0; i < run; i++)
+        {
+            markAllocated(pool, &runPairs[i]);
+            runPairs[i].dr = &runPairs[i + 1];
+        }
+
+        *link = runPairs;
+        link = (struct pair **)&runPairs[run - 1].dr;
+        allocated += run;
+    }
+
+    // Collection is not allowed here because the list built so far is not reachable from roots
+
+    while(allocated < n)
+    {
+        struct pair * p = popFreePair(pool);
+
+        if(p == NULL)
+        {
+            *link = NULL;
+            freePairs(first, allocated);
+
+            return NULL;
+        }
+
+        markAllocated(pool, p);
+
+        *link = p;
+        link = (struct pair **)&p->dr;
+        allocated++;
+    }
+
+    *link = NULL;
+
+    return first;
+}
+
+// Frees first n pairs of a list linked through dr, every lock has to be held
+// Pairs go to their owners' free lists in list order, so they are handed out again in that order
+
+void freePairs(struct pair * p, size_t n)
+{
+    struct pair * first[MAX_NUMA_NODES] = { NULL };
+    struct pair * last[MAX_NUMA_NODES] = { NULL };
+
+    for(size_t i = 0; i < n && p != NULL; i++)
+    {
+        struct pair * next = p->dr;
+        struct nodePool * pool = pairOwner(p);
+        unsigned int node = pool - nodePools;
+
+        releasePair(pool, p);
+
+        if(last[node] == NULL)
+            first[node] = p;
+        else
+            last[node]->dr = p;
+
+        last[node] = p;
+        p = next;
+    }
+
+    for(unsigned int i = 0; i < numaNodeCount; i++)
+    {
+        if(last[i] == NULL)
+            continue;
+
+        last[i]->dr = nodePools[i].freeHead;
+        nodePools[i].freeHead = first[i];
+    }
+}
+
+// Public entry points
+
+struct pair * lalloc()
+{
+    if(lpoolInit())
+        return NULL;
+
+    struct nodePool * pool = &nodePools[currentNode()];
+
+    pthread_mutex_lock(&pool->lock);
+
+    struct pair * p = allocFromNode(pool);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if(p == NULL)
+    {
+        lockPools();
+
+        p = refillAndAlloc(pool);
+
+        unlockPools();
+    }
+
+    return p;
+}
+
+void lfree(struct pair * p)
+{
+    struct nodePool * pool = pairOwner(p);
+    unsigned int node = pool - nodePools;
+
+    if(numaNodeCount > 1 && node != (unsigned int)currentNode())
+    {
+        queueRemoteFree(node, p);
+
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    freePair(pool, p);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+struct pair * lalloc_n(size_t n)
+{
+    if(n == 0 || lpoolInit())
+        return NULL;
+
+    struct nodePool * pool = &nodePools[currentNode()];
+
+    lockPools();
+
+    struct pair * p = allocPairs(pool, n);
+
+    unlockPools();
+
+    return p;
+}
+
+void lfree_n(struct pair * p, size_t n)
+{
+    lockPools();
+
+    freePairs(p, n);
+
+    unlockPools();
+}
+
+size_t lgcCollect()
+{
+    if(lpoolInit())
+        return 0;
+
+    lockPools();
+
+    size_t live = collectPairs();
+
+    unlockPools();
+
+    return live;
+}
+
+int lcompact()
+{
+    if(lpoolInit())
+        return 0;
+
+    lockPools();
+
+    int result = compactPairs();
+
+    unlockPools();
+
+    return result;
+}
+
+// Compact pairs, an alternative layout where ar and dr are 32 bit references instead of pointers
+// A cell is 8 bytes, so twice as many fit into a cache line as struct pair
+// Reference 0 is nil, odd references are small integers stored in the upper 31 bits
+// and other references are twice the index of a cell in the compact heap
+// Compact pairs have their own reserved heap and free list, they are not collected or compacted
+
+typedef uint32_t cref;
+
+struct cpair
+{
+    cref ar;
+    cref dr;
+};
+
+#define CPAIR_SIZE sizeof(struct cpair)
+#define CPAIR_NIL 0
+#define CPAIR_HEAP_RESERVE ((size_t)1 << 34)
+#define CPAIRS_PER_SLAB (SLAB_SIZE / CPAIR_SIZE)
+
+struct cpair * cpairHeap = NULL;
+size_t cpairReserved = 0;
+size_t cpairCommitted = 0;
+cref cpairFreeHead = CPAIR_NIL;
+size_t cpairBumpNext = 0;
+size_t cpairLiveCount = 0;
+
+static inline struct cpair * cpairPtr(cref ref)
+{
+    return &cpairHeap[ref >> 1];
+}
+
+static inline cref cpairMakeInt(int32_t value)
+{
+    return ((uint32_t)value << 1) | 1;
+}
+
+static inline int cpairIsInt(cref ref)
+{
+    return ref & 1;
+}
+
+static inline int32_t cpairIntValue(cref ref)
+{
+    return (int32_t)ref >> 1;
+}
+
+static inline int cpairIsPair(cref ref)
+{
+    return ref != CPAIR_NIL && ! (ref & 1);
+}
+
+// Reserves the compact heap, 2^31 cells is the most a reference can address
+// Cell 0 is never handed out so that index 0 can mean nil
+
+int cpairPoolInit()
+{
+    size_t reserve = CPAIR_HEAP_RESERVE;
+
+    if(reserve > ((size_t)1 << 31) * CPAIR_SIZE)
+        reserve = ((size_t)1 << 31) * CPAIR_SIZE;
+
+    while(reserve >= SLAB_SIZE)
+    {
+        void * heap = mmap(0, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if(heap != MAP_FAILED)
+        {
+            cpairHeap = heap;
+            cpairReserved = reserve / CPAIR_SIZE;
+            cpairBumpNext = 1;
+
+            return 0;
+        }
+
+        reserve /= 2;
+    }
+
+    return 1;
+}
+
+cref allocCpair()
+{
+    cref ref;
+
+    if(cpairHeap == NULL && cpairPoolInit())
+        return CPAIR_NIL;
+
+    if(cpairFreeHead != CPAIR_NIL)
+    {
+        ref = cpairFreeHead;
+        cpairFreeHead = cpairPtr(ref)->dr;
+    }
+    else
+    {
+        if(cpairBumpNext >= cpairCommitted)
+        {
+            if(cpairCommitted + CPAIRS_PER_SLAB > cpairReserved)
+                return CPAIR_NIL;
+
+            if(mprotect(&cpairHeap[cpairCommitted], SLAB_SIZE, PROT_READ | PROT_WRITE))
+                return CPAIR_NIL;
+
+            cpairCommitted += CPAIRS_PER_SLAB;
+        }
+
+        ref = cpairBumpNext++ << 1;
+    }
+
+    cpairPtr(ref)->ar = CPAIR_NIL;
+    cpairPtr(ref)->dr = CPAIR_NIL;
+
+    cpairLiveCount++;
+
+    return ref;
+}
+
+cref clalloc()
+{
+    pthread_mutex_lock(&poolLock);
+
+    cref ref = allocCpair();
+
+    pthread_mutex_unlock(&poolLock);
+
+    return ref;
+}
+
+void clfree(cref ref)
+{
+    if(! cpairIsPair(ref))
+        return;
+
+    pthread_mutex_lock(&poolLock);
+
+    cpairPtr(ref)->ar = CPAIR_NIL;
+    cpairPtr(ref)->dr = cpairFreeHead;
+    cpairFreeHead = ref;
+
+    cpairLiveCount--;
+
+    pthread_mutex_unlock(&poolLock);
+}
+
+// Benchmark comparing lalloc with glibc malloc
+// Usage: linux_dot_pair_allocator [workload] [operations] [threads]
+// workload is one of churn, list, tree, mtchurn or all
+
+#define CHURN_WINDOW 4096
+#define BENCH_DEFAULT_OPS 2000000
+#define BENCH_DEFAULT_THREADS 4
+
+struct benchAllocator
+{
+    const char * name;
+    struct pair * (* alloc)();
+    void (* free)(struct pair * p);
+};
+
+struct benchResult
+{
+    double nsPerOp;
+    long rssKb;
+    long long cacheMisses;
+};
+
+struct benchThreadInfo
+{
+    struct benchAllocator * allocator;
+    size_t ops;
+    unsigned int seed;
+};
+
+struct pair * mallocPair()
+{
+    return calloc(1, sizeof(struct pair));
+}
+
+void freeMallocPair(struct pair * p)
+{
+    free(p);
+}
+
+long currentRssKb()
+{
+    long pages = 0, resident = 0;
+    FILE * statm = fopen("/proc/self/statm", "r");
+
+    if(statm == NULL)
+        return -1;
+
+    if(fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        resident = -1;
+
+    fclose(statm);
+
+    return resident * (PAGE_SIZE / 1024);
+}
+
+// Highest RSS seen while a workload runs, sampled at the point where most memory is live
+// Threads of mtchurn sample at the same time, so the maximum is kept with compare and swap
+
+long benchPeakRss = 0;
+
+void sampleRss()
+{
+    long rss = currentRssKb();
+    long peak = __atomic_load_n(&benchPeakRss, __ATOMIC_RELAXED);
+
+    // A failed swap reloads peak, so this ends once rss is stored or another thread saw more
+    while(rss > peak)
+    {
+        if(__atomic_compare_exchange_n(&benchPeakRss, &peak, rss, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+}
+
+// Opens a cache miss counter for this process and threads it creates
+// Returns -1 if perf events are not available (no permission, no PMU in a VM...)
+
+int openCacheMissCounter()
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+double elapsedNs(struct timespec * start, struct timespec * end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// Keeps a window of live pairs and replaces a random one every operation
+
+void churn(struct benchAllocator * allocator, size_t ops, unsigned int seed)
+{
+    struct pair * window[CHURN_WINDOW];
+
+    for(int i = 0; i < CHURN_WINDOW; i++)
+        window[i] = allocator->alloc();
+
+    for(size_t i = 0; i < ops; i++)
+    {
+        int slot = rand_r(&seed) % CHURN_WINDOW;
+
+        allocator->free(window[slot]);
+        window[slot] = allocator->alloc();
+        window[slot]->ar = (void *)i;
+    }
+
+    sampleRss();
+
+    for(int i = 0; i < CHURN_WINDOW; i++)
+        allocator->free(window[i]);
+}
+
+void * churnThread(void * args)
+{
+    struct benchThreadInfo * info = args;
+
+    churn(info->allocator, info->ops, info->seed);
+
+    return NULL;
+}
+
+void benchChurn(struct benchAllocator * allocator, size_t ops, int threads)
+{
+    (void)threads;
+
+    churn(allocator, ops, 1);
+}
+
+void benchMtChurn(struct benchAllocator * allocator, size_t ops, int threads)
+{
+    pthread_t * threadId = malloc(threads * sizeof(pthread_t));
+    struct benchThreadInfo * info = malloc(threads * sizeof(struct benchThreadInfo));
+
+    for(int i = 0; i < threads; i++)
+    {
+        info[i].allocator = allocator;
+        info[i].ops = ops / threads;
+        info[i].seed = i + 1;
+
+        pthread_create(&threadId[i], NULL, churnThread, &info[i]);
+    }
+
+    for(int i = 0; i < threads; i++)
+        pthread_join(threadId[i], NULL);
+
+    free(threadId);
+    free(info);
+}
+
+// Builds one long list, walks it a few times and frees it
+
+void benchList(struct benchAllocator * allocator, size_t ops, int threads)
+{
+    struct pair * list = NULL;
+    size_t sum = 0;
+
+    (void)threads;
+
+    for(size_t i = 0; i < ops; i++)
+    {
+        struct pair * p = allocator->alloc();
+
+        p->ar = (void *)i;
+        p->dr = list;
+        list = p;
+    }
+
+    sampleRss();
+
+    for(int pass = 0; pass < 4; pass++)
+    {
+        for(struct pair * p = list; p != NULL; p = p->dr)
+            sum += (size_t)p->ar;
+    }
+
+    while(list != NULL)
+    {
+        struct pair * next = list->dr;
+
+        allocator->free(list);
+        list = next;
+    }
+
+    if(sum == 1)
+        printf("\n");
+}
+
+// Same as benchList but the list comes from a single lalloc_n call
+
+void benchBulkList(struct benchAllocator * allocator, size_t ops, int threads)
+{
+    size_t sum = 0;
+
+    (void)allocator;
+    (void)threads;
+
+    struct pair * list = lalloc_n(ops);
+    size_t i = 0;
+
+    for(struct pair * p = list; p != NULL; p = p->dr)
+        p->ar = (void *)i++;
+
+    sampleRss();
+
+    for(int pass = 0; pass < 4; pass++)
+    {
+        for(struct pair * p = list; p != NULL; p = p->dr)
+            sum += (size_t)p->ar;
+    }
+
+    lfree_n(list, ops);
+
+    if(sum == 1)
+        printf("\n");
+}
+
+// Same as benchList built from compact pairs holding immediate integers
+
+void benchCompactList(struct benchAllocator * allocator, size_t ops, int threads)
+{
+    cref list = CPAIR_NIL;
+    int64_t sum = 0;
+
+    (void)allocator;
+    (void)threads;
+
+    for(size_t i = 0; i < ops; i++)
+    {
+        cref p = clalloc();
+
+        cpairPtr(p)->ar = cpairMakeInt((int32_t)i);
+        cpairPtr(p)->dr = list;
+        list = p;
+    }
+
+    sampleRss();
+
+    for(int pass = 0; pass < 4; pass++)
+    {
+        for(cref p = list; p != CPAIR_NIL; p = cpairPtr(p)->dr)
+            sum += cpairIntValue(cpairPtr(p)->ar);
+    }
+
+    while(list != CPAIR_NIL)
+    {
+        cref next = cpairPtr(list)->dr;
+
+        clfree(list);
+        list = next;
+    }
+
+    if(sum == 1)
+        printf("\n");
+}
+
+// Hangs every new node under a random earlier node, ar and dr are the children
+
+size_t countTree(struct pair * root)
+{
+    size_t count = 0;
+    struct pair ** stack = malloc(64 * sizeof(struct pair *));
+    size_t stackLen = 0, stackCapacity = 64;
+
+    stack[stackLen++] = root;
+
+    while(stackLen > 0)
+    {
+        struct pair * p = stack[--stackLen];
+
+        count++;
+
+        if(stackLen + 2 > stackCapacity)
+        {
+            stackCapacity *= 2;
+            stack = realloc(stack, stackCapacity * sizeof(struct pair *));
+        }
+
+        if(p->ar != NULL)
+            stack[stackLen++] = p->ar;
+
+        if(p->dr != NULL)
+            stack[stackLen++] = p->dr;
+    }
+
+    free(stack);
+
+    return count;
+}
+
+void benchTree(struct benchAllocator * allocator, size_t ops, int threads)
+{
+    struct pair ** nodes = malloc(ops * sizeof(struct pair *));
+    unsigned int seed = 1;
+
+    (void)threads;
+
+    nodes[0] = allocator->alloc();
+    nodes[0]->ar = NULL;
+    nodes[0]->dr = NULL;
+
+    for(size_t i = 1; i < ops; i++)
+    {
+        struct pair * parent = nodes[rand_r(&seed) % i];
+        struct pair * node = allocator->alloc();
+
+        node->ar = NULL;
+        node->dr = NULL;
+
+        // Walk down until a free child slot is found
+        while(1)
+        {
+            void ** child = rand_r(&seed) & 1 ? &parent->ar : &parent->dr;
+
+            if(*child == NULL)
+            {
+                *child = node;
+
+                break;
+            }
+
+            parent = *child;
+        }
+
+        nodes[i] = node;
+    }
+
+    sampleRss();
+
+    if(countTree(nodes[0]) != ops)
+        printf("Tree benchmark lost nodes!\n");
+
+    for(size_t i = 0; i < ops; i++)
+        allocator->free(nodes[i]);
+
+    free(nodes);
+}
+
+struct benchResult runBench(void (* workload)(struct benchAllocator *, size_t, int),
+    struct benchAllocator * allocator, size_t ops, int threads)
+{
+    struct benchResult result;
+    struct timespec start, end;
+    int counter = openCacheMissCounter();
+
+    long startRss = currentRssKb();
+
+    benchPeakRss = startRss;
+
+    if(counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    workload(allocator, ops, threads);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    result.cacheMisses = -1;
+
+    if(counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+
+        if(read(counter, &result.cacheMisses, sizeof(result.cacheMisses)) != sizeof(result.cacheMisses))
+            result.cacheMisses = -1;
+
+        close(counter);
+    }
+
+    result.nsPerOp = elapsedNs(&start, &end) / ops;
+    result.rssKb = benchPeakRss - startRss;
+
+    return result;
+}
+
+void printBenchResult(const char * workload, const char * allocator, struct benchResult result)
+{
+    printf("%-10s %-10s %10.1f %12ld ", workload, allocator, result.nsPerOp, result.rssKb);
+
+    if(result.cacheMisses >= 0)
+        printf("%14lld\n", result.cacheMisses);
+    else
+        printf("%14s\n", "n/a");
+}
+
+int main(int argc, char ** argv)
+{
+    const char * selected = argc > 1 ? argv[1] : "all";
+    size_t ops = argc > 2 ? strtoull(argv[2], NULL, 10) : BENCH_DEFAULT_OPS;
+    int threads = argc > 3 ? atoi(argv[3]) : BENCH_DEFAULT_THREADS;
+
+    struct benchAllocator allocators[] =
+    {
+        { "malloc", mallocPair, freeMallocPair },
+        { "lalloc", lalloc, lfree },
+    };
+
+    struct
+    {
+        const char * name;
+        void (* run)(struct benchAllocator *, size_t, int);
+    } workloads[] =
+    {
+        { "churn", benchChurn },
+        { "list", benchList },
+        { "tree", benchTree },
+        { "mtchurn", benchMtChurn },
+    };
+
+    int workloadCount = sizeof(workloads) / sizeof(workloads[0]);
+    int found = 0;
+
+    if(ops == 0 || threads < 1)
+    {
+        printf("Usage: %s [churn|list|tree|mtchurn|all] [operations] [threads]\n", argv[0]);
+
+        return 1;
+    }
+
+    for(int w = 0; w < workloadCount; w++)
+    {
+        if(strcmp(selected, "all") != 0 && strcmp(selected, workloads[w].name) != 0)
+            continue;
+
+        // RSS is growth of the process during a workload, memory kept by an allocator from
+        // an earlier run is reused and does not show up again
+        if(! found)
+            printf("%-10s %-10s %10s %12s %14s\n", "workload", "allocator", "ns/op", "+rss kB", "cache misses");
+
+        found = 1;
+
+        for(int a = 0; a < 2; a++)
+            printBenchResult(workloads[w].name, allocators[a].name, runBench(workloads[w].run, &allocators[a], ops, threads));
+
+        if(workloads[w].run == benchList)
+        {
+            printBenchResult("list", "lalloc_n", runBench(benchBulkList, &allocators[1], ops, threads));
+            printBenchResult("list", "clalloc", runBench(benchCompactList, &allocators[1], ops, threads));
+        }
+    }
+
+    if(! found)
+    {
+        printf("Unknown workload %s\n", selected);
+
+        return 1;
+    }
+
+    lallocPrintStats();
+
     return 0;
 }
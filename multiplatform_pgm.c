@@ -3,12 +3,42 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+// pshufb kernels are built for every x86 target and picked by what the CPU has at run time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PSHUFB_DISPATCH
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#elif defined(_M_X64)
+#include <intrin.h>
+#define PSHUFB_DISPATCH
+#define TARGET_AVX2
+#define TARGET_SSSE3
+#endif
 
 #ifdef __linux__
 
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+// io_uring is used through raw system calls, only the kernel header is needed
+#if defined(__has_include) && defined(__NR_io_uring_setup)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
 
 #endif
 
@@ -25,7 +55,113 @@
 
 #endif
 
-#define INT_MAX_DIGITS 10
+#define MAX_THREADS 256
+
+// Thread functions have different signatures on each platform
+
+#ifdef __linux__
+
+typedef pthread_t threadHandle;
+
+#define THREAD_FUNC void*
+#define THREAD_RETURN return NULL
+
+#endif
+
+#ifdef _WIN32
+
+typedef HANDLE threadHandle;
+
+#define THREAD_FUNC DWORD WINAPI
+#define THREAD_RETURN return 0
+
+#endif
+
+// Lock and condition variable used to hand buffers between threads
+
+typedef struct
+{
+#ifdef __linux__
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE cond;
+#endif
+} syncPoint;
+
+void syncInit(syncPoint* sp)
+{
+#ifdef __linux__
+    pthread_mutex_init(&sp->lock, NULL);
+    pthread_cond_init(&sp->cond, NULL);
+#endif
+
+#ifdef _WIN32
+    InitializeCriticalSection(&sp->lock);
+    InitializeConditionVariable(&sp->cond);
+#endif
+}
+
+void syncDestroy(syncPoint* sp)
+{
+#ifdef __linux__
+    pthread_mutex_destroy(&sp->lock);
+    pthread_cond_destroy(&sp->cond);
+#endif
+
+#ifdef _WIN32
+    DeleteCriticalSection(&sp->lock);
+#endif
+}
+
+void syncLock(syncPoint* sp)
+{
+#ifdef __linux__
+    pthread_mutex_lock(&sp->lock);
+#endif
+
+#ifdef _WIN32
+    EnterCriticalSection(&sp->lock);
+#endif
+}
+
+void syncUnlock(syncPoint* sp)
+{
+#ifdef __linux__
+    pthread_mutex_unlock(&sp->lock);
+#endif
+
+#ifdef _WIN32
+    LeaveCriticalSection(&sp->lock);
+#endif
+}
+
+// Has to be called with the lock held
+
+void syncWait(syncPoint* sp)
+{
+#ifdef __linux__
+    pthread_cond_wait(&sp->cond, &sp->lock);
+#endif
+
+#ifdef _WIN32
+    SleepConditionVariableCS(&sp->cond, &sp->lock, INFINITE);
+#endif
+}
+
+void syncWakeAll(syncPoint* sp)
+{
+#ifdef __linux__
+    pthread_cond_broadcast(&sp->cond);
+#endif
+
+#ifdef _WIN32
+    WakeAllConditionVariable(&sp->cond);
+#endif
+}
 
 // Struct containing all relevant data to process a PGM file
 
@@ -48,6 +184,8 @@ typedef struct PGMIMAGE
 #endif
 
     char* data;
+    long dataStart;
+    int format;
     int width;
     int height;
     int depth;
@@ -75,382 +213,3497 @@ TCHAR* getFilePath(char* path)
 
 #endif
 
-// Gets head information of PGM file (height, width and gray depth)
-// Function assumes that a PGM file has correct form
-// Finds first 4 string, ignores first string (P2) and extracts information 
+// Unmaps and closes PGM file
+
+void closePgmFile(pgmImage img)
+{
+#ifdef __linux__
+
+    munmap(img.data, img.dataLen);
+    close(img.fd);
+
+#endif
+
+#ifdef _WIN32
+
+    UnmapViewOfFile(img.fileData);
+    CloseHandle(img.hMapping);
+    CloseHandle(img.fd);
+
+#endif
+}
+
+// Header of a PGM file, filled by pgmParse
 
-void getPgmHeadInfo(char* imgData, int* width, int* height, int* grayDepth)
+typedef struct
 {
-    int strCnt = 0, strFound = 0, strLen = 0, isComment = 0;
-    char widthStr[INT_MAX_DIGITS + 1];
-    char heightStr[INT_MAX_DIGITS + 1];
-    char grayDepthStr[INT_MAX_DIGITS + 1];
-    char currChar = ' ';
+    int format;
+    int width;
+    int height;
+    int depth;
+    long dataStart;
+} pgmHeader;
+
+#define PGM_OK 0
+#define PGM_ERR_MAGIC 1
+#define PGM_ERR_HEADER 2
+#define PGM_ERR_SIZE 3
+#define PGM_ERR_DEPTH 4
+#define PGM_ERR_SHORT 5
+#define PGM_ERR_PIXELS 6
+
+// Largest accepted width and height, and largest pixel count of images loaded into memory so
+// sizes fit into a long everywhere, streaming only holds a few rows and takes any pixel count
+#define PGM_MAX_SIDE (1 << 24)
+
+#ifndef PGM_MAX_PIXELS
+#define PGM_MAX_PIXELS (1LL << 30)
+#endif
 
-    for (int i = 0; 4 > strCnt; i++)
+const char* pgmErrorString(int error)
+{
+    switch (error)
     {
-        currChar = imgData[i];
+    case PGM_OK:
+        return "No error";
+
+    case PGM_ERR_MAGIC:
+        return "Not a P2 or P5 PGM file";
+
+    case PGM_ERR_HEADER:
+        return "Could not read PGM header";
+
+    case PGM_ERR_SIZE:
+        return "Image width or height is 0 or too large";
+
+    case PGM_ERR_DEPTH:
+        return "Gray depth has to be between 1 and 65535";
+
+    case PGM_ERR_SHORT:
+        return "File has less pixel data than width * height";
+
+    case PGM_ERR_PIXELS:
+        return "Image has too many pixels to convert in memory, -s streams it";
+
+    default:
+        return "Unknown error";
+    }
+}
+
+// Reads and checks the header in one pass over the first len bytes of data
+// Numbers have to be plain digits, comments run from '#' to the end of the line and exactly one
+// whitespace character follows the gray depth, dataStart is the offset after it
+// fileLen is the size of the whole file, binary files shorter than width * height are rejected,
+// -1 skips that check when the size is not known yet
+// Returns PGM_OK or one of the PGM_ERR codes
+
+int pgmParse(const char* data, long len, long fileLen, pgmHeader* header)
+{
+    long long values[3];
+    long i = 2;
+
+    memset(header, 0, sizeof(pgmHeader));
 
-        if (currChar == '#')
-            isComment = 1;
+    if (len < 3 || data[0] != 'P' || (data[1] != '2' && data[1] != '5') || !isspace((unsigned char)data[2]))
+        return PGM_ERR_MAGIC;
 
-        if (isspace(currChar) && !isComment)
+    header->format = data[1] - '0';
+
+    for (int token = 0; token < 3; token++)
+    {
+        // Whitespace and comments before the number
+        while (i < len && (isspace((unsigned char)data[i]) || data[i] == '#'))
         {
-            if (strFound)
+            if (data[i] == '#')
             {
-                strLen = 0;
-                strCnt++;
+                while (i < len && data[i] != '\n')
+                    i++;
             }
-
-            strFound = 0;
+            else
+                i++;
         }
 
-        if ((isalpha(currChar) || isdigit(currChar)) && !isComment)
-            strFound = 1;
+        if (i >= len || !isdigit((unsigned char)data[i]))
+            return PGM_ERR_HEADER;
+
+        long long value = 0;
 
-        if (strFound && !isComment)
+        // Anything above PGM_MAX_SIDE is rejected anyway, so stop growing there
+        for (; i < len && isdigit((unsigned char)data[i]); i++)
         {
-            switch (strCnt)
-            {
-            case 1:
-                widthStr[strLen] = currChar;
-                break;
+            if (value <= PGM_MAX_SIDE)
+                value = value * 10 + (data[i] - '0');
+        }
 
-            case 2:
-                heightStr[strLen] = currChar;
-                break;
+        if (i >= len || !(isspace((unsigned char)data[i]) || (token < 2 && data[i] == '#')))
+            return PGM_ERR_HEADER;
 
-            case 3:
-                grayDepthStr[strLen] = currChar;
-                break;
+        values[token] = value;
+    }
 
-            default:
-                break;
-            }
+    if (values[0] < 1 || values[1] < 1 || values[0] > PGM_MAX_SIDE || values[1] > PGM_MAX_SIDE)
+        return PGM_ERR_SIZE;
 
-            strLen++;
-        }
+    if (values[2] < 1 || values[2] > 65535)
+        return PGM_ERR_DEPTH;
 
-        if (isComment && currChar == '\n')
-            isComment = 0;
-    }
+    header->width = (int)values[0];
+    header->height = (int)values[1];
+    header->depth = (int)values[2];
+    header->dataStart = i + 1;
 
-    *width = atoi(widthStr);
-    *height = atoi(heightStr);
-    *grayDepth = atoi(grayDepthStr);
+    if (header->format == 5 && fileLen >= 0
+        && fileLen - header->dataStart < values[0] * values[1] * (header->depth < 256 ? 1 : 2))
+        return PGM_ERR_SHORT;
+
+    return PGM_OK;
 }
 
-// Function opens a PGM file, then maps it into memory
+// Function opens a PGM file, maps it into memory and checks its header
+// Returns 0 on success, errors are printed
 
-pgmImage getPgmFile(char* path)
+int getPgmFile(char* path, pgmImage* img)
 {
-    pgmImage img;
+    pgmHeader header;
+
+    memset(img, 0, sizeof(pgmImage));
 
 #ifdef __linux__
-    img.fd = open(path, O_RDONLY);
+    img->fd = open(path, O_RDONLY);
 #endif
 
 #ifdef _WIN32
 
     TCHAR* winPath = getFilePath(path);
 
-    img.fd = CreateFile(winPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    img->fd = CreateFile(winPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
 
 #endif
 
 #ifdef __linux__
-    if (!img.fd)
+    if (img->fd < 0)
 #endif
 
 #ifdef _WIN32
-        if (img.fd == INVALID_HANDLE_VALUE)
+        if (img->fd == INVALID_HANDLE_VALUE)
 #endif
         {
             printf("Failed to open file!\n");
 
-            return img;
+            return 1;
         }
 
 #ifdef __linux__
 
     struct stat st;
 
-    fstat(img.fd, &st);
+    fstat(img->fd, &st);
 
-    img.dataLen = st.st_size;
+    img->dataLen = st.st_size;
 
-    img.data = mmap(NULL, img.dataLen, PROT_READ, MAP_PRIVATE, img.fd, 0);
+    img->data = img->dataLen > 0 ? mmap(NULL, img->dataLen, PROT_READ, MAP_PRIVATE, img->fd, 0) : MAP_FAILED;
 
 #endif
 
 #ifdef _WIN32
 
-    img.dataLen = GetFileSize(img.fd, NULL);
+    img->dataLen = GetFileSize(img->fd, NULL);
 
-    img.hMapping = CreateFileMapping(img.fd, NULL, PAGE_READONLY, 0, 0, NULL);
+    img->hMapping = img->dataLen > 0 ? CreateFileMapping(img->fd, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
 
-    if (img.hMapping == NULL)
+    if (img->hMapping == NULL)
     {
         printf("Unable to create file mapping\n");
 
-        return img;
+        CloseHandle(img->fd);
+
+        return 1;
     }
 
-    img.fileData = MapViewOfFile(img.hMapping, FILE_MAP_READ, 0, 0, img.dataLen);
+    img->fileData = MapViewOfFile(img->hMapping, FILE_MAP_READ, 0, 0, img->dataLen);
 
 #endif
 
 #ifdef __linux__
-    if (img.data == MAP_FAILED)
+    if (img->data == MAP_FAILED)
 #endif
 
 #ifdef _WIN32
-        if (img.fd == INVALID_HANDLE_VALUE)
+        if (img->fileData == NULL)
 #endif
         {
             printf("Mapping failed\n");
 
-            return img;
+#ifdef __linux__
+            close(img->fd);
+#endif
+
+#ifdef _WIN32
+            CloseHandle(img->hMapping);
+            CloseHandle(img->fd);
+#endif
+
+            return 1;
         }
 
 #ifdef _WIN32
-    img.data = (char*)img.fileData;
+    img->data = (char*)img->fileData;
 #endif
 
-    getPgmHeadInfo(img.data, &img.width, &img.height, &img.depth);
+    int error = pgmParse(img->data, img->dataLen, img->dataLen, &header);
 
-    return img;
-}
+    if (error == PGM_OK && (long long)header.width * header.height > PGM_MAX_PIXELS)
+        error = PGM_ERR_PIXELS;
 
-// Unmaps and closes PGM file
+    if (error != PGM_OK)
+    {
+        printf("%s!\n", pgmErrorString(error));
 
-void closePgmFile(pgmImage img)
-{
-#ifdef __linux__
+        closePgmFile(*img);
 
-    munmap(img.data, img.dataLen);
-    close(img.fd);
+        return 1;
+    }
 
-#endif
+    img->format = header.format;
+    img->width = header.width;
+    img->height = header.height;
+    img->depth = header.depth;
+    img->dataStart = header.dataStart;
 
-#ifdef _WIN32
+    return 0;
+}
 
-    UnmapViewOfFile(img.fileData);
-    CloseHandle(img.hMapping);
-    CloseHandle(img.fd);
+// File access shared by all modes, input is read with plain reads and output goes through one of
+// the output backends below
 
+#ifdef __linux__
+typedef int fileHandle;
 #endif
-}
 
-int digitsToInt(int* digits, int digCnt)
+#ifdef _WIN32
+typedef HANDLE fileHandle;
+#endif
+
+fileHandle openInputFile(char* path)
 {
-    int digitPlace = 1;
-    int result = 0;
+#ifdef __linux__
+    fileHandle fd = open(path, O_RDONLY);
 
-    for (int i = 1; i < digCnt; i++)
-        digitPlace *= 10;
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (fd >= 0)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
 
-    for (int i = 0; i < digCnt; i++)
-    {
-        result += digits[i] * digitPlace;
+#ifdef _WIN32
+    TCHAR* winPath = getFilePath(path);
 
-        digitPlace /= 10;
-    }
+    fileHandle fd = CreateFile(winPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+#endif
 
-    return result;
+    return fd;
 }
 
-// Opens a file and maps it into memory 
-// then writes character from data buffer into said file
-
-int writeToTextFile(char* path, char* data, int len)
+int isOpenFile(fileHandle fd)
 {
 #ifdef __linux__
-    int fd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    return fd >= 0;
 #endif
 
 #ifdef _WIN32
-
-    TCHAR* winPath = getFilePath(path);
-
-    HANDLE fd = CreateFile(winPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, 0, NULL);
-
+    return fd != INVALID_HANDLE_VALUE;
 #endif
+}
 
+void closeFile(fileHandle fd)
+{
 #ifdef __linux__
-    if (!fd)
+    close(fd);
 #endif
 
 #ifdef _WIN32
-        if (fd == INVALID_HANDLE_VALUE)
+    CloseHandle(fd);
 #endif
-        {
-            printf("Failed to open file!\n");
+}
 
-            return 1;
-        }
+// Reads up to len bytes, returns number of bytes read, 0 at end of file and -1 on failure
 
+long readSome(fileHandle fd, char* buffer, size_t len)
+{
 #ifdef __linux__
-
-    ftruncate(fd, len);
-
-    char* fileData = mmap(NULL, len, PROT_WRITE, MAP_SHARED, fd, 0);
-
+    return (long)read(fd, buffer, len);
 #endif
 
 #ifdef _WIN32
+    DWORD readBytes = 0;
 
-    DWORD fileLen = (DWORD)len;
+    if (!ReadFile(fd, buffer, (DWORD)len, &readBytes, NULL))
+        return -1;
 
-    HANDLE hMapping = CreateFileMapping(fd, NULL, PAGE_READWRITE, 0, fileLen, NULL);
-
-    if (hMapping == NULL)
-    {
-        printf("Unable to create file mapping\n");
+    return (long)readBytes;
+#endif
+}
 
-        return 1;
-    }
+// Moves back to the start of the file, returns 1 on failure
 
-    LPVOID fileData = MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, fileLen);
+int rewindFile(fileHandle fd)
+{
+#ifdef __linux__
+    return lseek(fd, 0, SEEK_SET) != 0;
+#endif
 
+#ifdef _WIN32
+    return SetFilePointer(fd, 0, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER;
 #endif
+}
 
+// Writes all of len bytes, returns 1 on failure
+
+int writeAll(fileHandle fd, const char* data, size_t len)
+{
+    while (len > 0)
+    {
 #ifdef __linux__
-    if (fileData == MAP_FAILED)
+        ssize_t written = write(fd, data, len);
+
+        if (written <= 0)
+            return 1;
 #endif
 
 #ifdef _WIN32
-        if (fileData == NULL)
-#endif
-        {
-            printf("Mapping failed\n");
+        DWORD written = 0;
+        DWORD toWrite = len > 0x40000000 ? 0x40000000 : (DWORD)len;
 
+        if (!WriteFile(fd, data, toWrite, &written, NULL) || written == 0)
             return 1;
-        }
+#endif
 
-#ifdef __linux__
+        data += written;
+        len -= written;
+    }
 
-    strcpy(fileData, data);
+    return 0;
+}
 
-    munmap(fileData, len);
+// Output backends, picked at runtime with -w
+// write:   one large write per buffer
+// pwritev: buffers that are ready together go out in one gathered write at explicit offsets
+// uring:   writes are queued on an io_uring and complete while the next rows are converted,
+//          if the kernel refuses to set up a ring the write backend is used instead
+// Windows only has the write backend
 
-    close(fd);
+#define OUTPUT_WRITE 0
+#define OUTPUT_PWRITEV 1
+#define OUTPUT_URING 2
 
-#endif
+// Largest piece of a buffer handed to the kernel at once
+#define OUTPUT_CHUNK (1 << 20)
+#define OUTPUT_URING_DEPTH 8
+#define OUTPUT_MAX_IOV 64
 
-#ifdef _WIN32
+#ifdef HAVE_IO_URING
 
-    memcpy(fileData, data, (size_t)len);
+// Submission and completion rings shared with the kernel, set up without liburing
 
-    UnmapViewOfFile(fileData);
-    CloseHandle(hMapping);
-    CloseHandle(fd);
+typedef struct
+{
+    int fd;
+    unsigned entries;
+    unsigned inFlight;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingLen;
+    void* cqRing;
+    size_t cqRingLen;
+    size_t sqesLen;
+} uringQueue;
+
+// One queued write, pending is decremented once all of it is written
+
+typedef struct
+{
+    const char* data;
+    size_t len;
+    long long offset;
+    int* pending;
+} uringWrite;
 
-#endif
+void uringFree(uringQueue* ring)
+{
+    munmap(ring->sqes, ring->sqesLen);
 
-    return 0;
+    if (ring->cqRingLen != 0)
+        munmap(ring->cqRing, ring->cqRingLen);
 
+    munmap(ring->sqRing, ring->sqRingLen);
+    close(ring->fd);
 }
 
-// Function skips first 4 strings the reads height * width string 
-// and converts them to ascii characters based on a provided pallette 
-// Function assumes that a PGM file has correct form
+// Returns 0 on success
 
-char* createASCIIArt(pgmImage img, char* pallette)
+int uringSetup(uringQueue* ring, unsigned entries)
 {
-    int valCnt = 0, valFound = 0, digCnt = 0, isComment = 0, indentCnt = 0, valsIndex = 0;
-    char* result = NULL, currChar = ' ';
-    int digits[INT_MAX_DIGITS + 1];
+    struct io_uring_params params;
 
-    result = (char*)malloc((img.width + 1) * img.height);
-
-    for (int i = 0; i < img.dataLen; i++)
-    {
-        currChar = img.data[i];
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(uringQueue));
 
-        if (currChar == '#')
-            isComment = 1;
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
 
-        if (isspace(currChar) && !isComment)
-        {
-            if (valFound)
-            {
-                valCnt++;
+    if (ring->fd < 0)
+        return 1;
 
-                if (valCnt > 4)
-                {
-                    int palletteIndex = digitsToInt(digits, digCnt);
+    ring->entries = params.sq_entries;
+    ring->sqRingLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
 
-                    result[valsIndex] = pallette[palletteIndex];
+    // Newer kernels map both rings with one mapping
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cqRingLen > ring->sqRingLen)
+            ring->sqRingLen = ring->cqRingLen;
 
-                    valsIndex++;
-                    indentCnt++;
+        ring->cqRingLen = 0;
+    }
 
-                    if (indentCnt % img.width == 0)
-                    {
-                        result[valsIndex] = '\n';
+    ring->sqRing = mmap(NULL, ring->sqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cqRing = ring->cqRingLen == 0 ? ring->sqRing
+        : mmap(NULL, ring->cqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
 
-                        valsIndex++;
-                    }
-                }
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        if (ring->sqRing != MAP_FAILED)
+            munmap(ring->sqRing, ring->sqRingLen);
 
-                digCnt = 0;
-            }
+        if (ring->cqRingLen != 0 && ring->cqRing != MAP_FAILED)
+            munmap(ring->cqRing, ring->cqRingLen);
 
-            valFound = 0;
-        }
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqesLen);
 
-        if ((isdigit(currChar)) && !isComment)
-            valFound = 1;
+        close(ring->fd);
 
-        if (valFound && !isComment && valCnt >= 4)
-        {
-            digits[digCnt] = currChar - '0';
+        return 1;
+    }
 
-            digCnt++;
-        }
+    char* sq = ring->sqRing;
+    char* cq = ring->cqRing;
+
+    ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // IORING_OP_WRITE came with kernel 5.6 together with probing, older kernels fail the probe
+    size_t probeLen = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, probeLen);
+    int supported = probe != NULL
+        && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0
+        && probe->last_op >= IORING_OP_WRITE
+        && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+
+    free(probe);
+
+    if (!supported)
+    {
+        uringFree(ring);
 
-        if (isComment && currChar == '\n')
-            isComment = 0;
+        return 1;
     }
 
-    return result;
+    return 0;
 }
 
-int main(int argc, char* argv[])
+// Queues one write and hands it to the kernel
+// Returns 0 on success
+
+int uringSubmitWrite(uringQueue* ring, int fd, uringWrite* request)
 {
-    if (argc != 4)
-    {
-        printf("Too many or too few arguments!\n");
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
 
-        return 1;
-    }
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
 
-    char* pgmFile = argv[1];
-    char* txtFile = argv[2];
-    char* pallette = argv[3];
-    char* buffer = NULL;
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)request->offset;
+    sqe->addr = (uint64_t)(uintptr_t)request->data;
+    sqe->len = (uint32_t)request->len;
+    sqe->user_data = (uint64_t)(uintptr_t)request;
 
-    int palletteDepth = strlen(pallette);
+    ring->sqArray[index] = index;
 
-    pgmImage img = getPgmFile(pgmFile);
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
 
-    if (img.depth > palletteDepth)
+    // If the kernel did not take the entry it is taken back out of the ring, otherwise a later
+    // enter would submit it after the caller already wrote the data and freed the request
+    if (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) != 1
+        && __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == tail)
     {
-        printf("Pallette too short! Needs to be at least %d characters long\n", img.depth);
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
 
         return 1;
     }
 
-    int ASCIIimgLen = (img.width + 1) * img.height;
+    ring->inFlight++;
 
-    buffer = createASCIIArt(img, pallette);
+    return 0;
+}
 
-    closePgmFile(img);
+// Waits for at least one completion and handles all that are ready
+// Short writes are finished with plain pwrite
+// Returns 1 if a write failed
 
-    writeToTextFile(txtFile, buffer, ASCIIimgLen);
+int uringReap(uringQueue* ring, int fd)
+{
+    int failed = 0;
+    unsigned head = *ring->cqHead;
+
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)
+        && syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        return 1;
+
+    while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+        uringWrite* request = (uringWrite*)(uintptr_t)cqe->user_data;
+        long long written = cqe->res;
+
+        if (written < 0)
+            failed = 1;
+
+        while (written >= 0 && (size_t)written < request->len)
+        {
+            ssize_t more = pwrite(fd, request->data + written, request->len - written, request->offset + written);
+
+            if (more <= 0)
+            {
+                failed = 1;
+
+                break;
+            }
+
+            written += more;
+        }
+
+        (*request->pending)--;
+        free(request);
+
+        head++;
+        ring->inFlight--;
+    }
+
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+    return failed;
+}
+
+#endif
+
+// An open output file, writes are appended at offset
+
+typedef struct
+{
+    fileHandle fd;
+    int backend;
+    long long offset;
+    int failed;
+
+#ifdef HAVE_IO_URING
+    uringQueue ring;
+#endif
+} outputFile;
+
+// Creates or truncates the output file
+// Returns 0 on success
+
+int outputOpen(outputFile* out, char* path, int backend)
+{
+    out->offset = 0;
+    out->failed = 0;
+    out->backend = OUTPUT_WRITE;
+
+#ifdef __linux__
+    out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+    if (out->fd < 0)
+        return 1;
+
+    if (backend == OUTPUT_PWRITEV)
+        out->backend = OUTPUT_PWRITEV;
+
+#ifdef HAVE_IO_URING
+    if (backend == OUTPUT_URING && uringSetup(&out->ring, OUTPUT_URING_DEPTH) == 0)
+        out->backend = OUTPUT_URING;
+#endif
+#endif
+
+#ifdef _WIN32
+    TCHAR* winPath = getFilePath(path);
+
+    (void)backend;
+
+    out->fd = CreateFile(winPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (out->fd == INVALID_HANDLE_VALUE)
+        return 1;
+#endif
+
+    return 0;
+}
+
+// Writes count buffers one after another at the end of the file
+// With the uring backend the writes are only queued, the buffers have to stay unchanged until
+// *pending, which is increased once per queued write, drops back, see outputWait
+// Other backends write before returning and leave pending alone
+
+void outputSubmit(outputFile* out, const char** buffers, const size_t* lens, int count, int* pending)
+{
+#ifdef HAVE_IO_URING
+    if (out->backend == OUTPUT_URING)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            for (size_t done = 0; done < lens[i]; done += OUTPUT_CHUNK)
+            {
+                uringWrite* request = (uringWrite*)malloc(sizeof(uringWrite));
+
+                while (out->ring.inFlight >= out->ring.entries)
+                    out->failed |= uringReap(&out->ring, out->fd);
+
+                if (request == NULL)
+                {
+                    out->failed = 1;
+
+                    return;
+                }
+
+                request->data = buffers[i] + done;
+                request->len = lens[i] - done < OUTPUT_CHUNK ? lens[i] - done : OUTPUT_CHUNK;
+                request->offset = out->offset;
+                request->pending = pending;
+
+                size_t len = request->len;
+
+                if (uringSubmitWrite(&out->ring, out->fd, request))
+                {
+                    // Nothing was queued, write it here instead
+                    out->failed |= pwrite(out->fd, request->data, len, request->offset) != (ssize_t)len;
+                    free(request);
+                }
+                else
+                    (*pending)++;
+
+                out->offset += len;
+            }
+        }
+
+        return;
+    }
+#endif
+
+#ifdef __linux__
+    if (out->backend == OUTPUT_PWRITEV)
+    {
+        struct iovec iov[OUTPUT_MAX_IOV];
+        int first = 0;
+
+        while (first < count)
+        {
+            int iovCnt = 0;
+            size_t total = 0;
+
+            for (; first < count && iovCnt < OUTPUT_MAX_IOV; first++, iovCnt++)
+            {
+                iov[iovCnt].iov_base = (void*)buffers[first];
+                iov[iovCnt].iov_len = lens[first];
+                total += lens[first];
+            }
+
+            // Partial writes continue from the first buffer that is not fully written
+            struct iovec* next = iov;
+
+            while (total > 0)
+            {
+                ssize_t written = pwritev(out->fd, next, iovCnt, out->offset);
+
+                if (written <= 0)
+                {
+                    out->failed = 1;
+
+                    return;
+                }
+
+                out->offset += written;
+                total -= written;
+
+                while (iovCnt > 0 && (size_t)written >= next->iov_len)
+                {
+                    written -= next->iov_len;
+                    next++;
+                    iovCnt--;
+                }
+
+                if (iovCnt > 0)
+                {
+                    next->iov_base = (char*)next->iov_base + written;
+                    next->iov_len -= written;
+                }
+            }
+        }
+
+        return;
+    }
+#endif
+
+    for (int i = 0; i < count; i++)
+    {
+        out->failed |= writeAll(out->fd, buffers[i], lens[i]);
+        out->offset += lens[i];
+    }
+
+    (void)pending;
+}
+
+// Waits until all writes counted in pending are done
+
+void outputWait(outputFile* out, int* pending)
+{
+#ifdef HAVE_IO_URING
+    while (out->backend == OUTPUT_URING && *pending > 0)
+        out->failed |= uringReap(&out->ring, out->fd);
+#endif
+
+    (void)out;
+    (void)pending;
+}
+
+// Finishes queued writes and closes the file
+// Returns 1 if any write failed
+
+int outputClose(outputFile* out)
+{
+#ifdef HAVE_IO_URING
+    if (out->backend == OUTPUT_URING)
+    {
+        while (out->ring.inFlight > 0)
+            out->failed |= uringReap(&out->ring, out->fd);
+
+        uringFree(&out->ring);
+    }
+#endif
+
+    closeFile(out->fd);
+
+    return out->failed;
+}
+
+// Writes data buffer into a new text file, an existing file is truncated
+// Returns 0 on success
+
+int writeToTextFile(char* path, char* data, size_t len, int backend)
+{
+    outputFile out;
+    int pending = 0;
+    const char* buffers[1] = { data };
+
+    if (outputOpen(&out, path, backend))
+    {
+        printf("Failed to open file!\n");
+
+        return 1;
+    }
+
+    outputSubmit(&out, buffers, &len, 1, &pending);
+    outputWait(&out, &pending);
+
+    if (outputClose(&out))
+    {
+        printf("Writing output failed!\n");
+
+        return 1;
+    }
+
+    return 0;
+}
+
+// Returns number of online processors, used as default number of threads
+
+int getCpuCount()
+{
+#ifdef __linux__
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return cpus > 0 ? (int)cpus : 1;
+#endif
+
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+
+    return (int)info.dwNumberOfProcessors;
+#endif
+}
+
+// Gives up the processor while waiting on another thread
+
+void yieldThread()
+{
+#ifdef __linux__
+    sched_yield();
+#endif
+
+#ifdef _WIN32
+    SwitchToThread();
+#endif
+}
+
+// Shared counters between threads
+
+#ifdef _MSC_VER
+#define atomicLoadInt(p) ((int)InterlockedOr((volatile LONG*)(p), 0))
+#define atomicStoreInt(p, v) InterlockedExchange((volatile LONG*)(p), (v))
+#define atomicAddInt(p, v) ((int)InterlockedExchangeAdd((volatile LONG*)(p), (v)))
+#else
+#define atomicLoadInt(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomicStoreInt(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomicAddInt(p, v) __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+#endif
+
+// Starts count threads running func, i-th thread gets args + i * argSize, then waits for all of them
+// Returns 1 if a thread could not be created, threads that did start are still waited for
+
+int runThreads(THREAD_FUNC (*func)(void*), void* args, size_t argSize, int count)
+{
+    threadHandle threads[MAX_THREADS];
+    int started = 0, failed = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        void* threadArgs = (char*)args + i * argSize;
+
+#ifdef __linux__
+        if (pthread_create(&threads[started], NULL, func, threadArgs))
+#endif
+
+#ifdef _WIN32
+        if ((threads[started] = CreateThread(NULL, 0, func, threadArgs, 0, NULL)) == NULL)
+#endif
+        {
+            // Run the work on this thread instead so nothing is left out
+            func(threadArgs);
+
+            failed = 1;
+
+            continue;
+        }
+
+        started++;
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+#ifdef __linux__
+        pthread_join(threads[i], NULL);
+#endif
+
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#endif
+    }
+
+    return failed;
+}
+
+// One part of pixel data processed by one thread
+// Chunks start at the beginning of a line so that no chunk starts inside a comment
+
+typedef struct
+{
+    char* data;
+    long start;
+    long end;
+    long firstValue;
+    long valueCnt;
+    int width;
+    long totalValues;
+    int maxValue;
+    char* pallette;
+    char* result;
+    uint16_t* values;
+} pgmChunk;
+
+// Splits pixel data into parts of similar size, each boundary is moved to the start of the next line
+// If the data has no line breaks at all, boundaries are moved to the next whitespace instead,
+// which is only safe without comments
+// Returns number of chunks, which can be lower than requested
+
+int splitsOnSpace(const char* data, long start, long end)
+{
+    return memchr(data + start, '\n', end - start) == NULL && memchr(data + start, '#', end - start) == NULL;
+}
+
+// Moves pos forward to the next place a chunk may start, see splitPixelData
+
+long chunkBoundary(const char* data, long pos, long end, int splitOnSpace)
+{
+    while (pos < end && !(splitOnSpace ? isspace((unsigned char)data[pos]) : data[pos - 1] == '\n'))
+        pos++;
+
+    return pos;
+}
+
+int splitPixelData(char* data, long start, long end, int parts, pgmChunk* chunks)
+{
+    long partLen = (end - start) / parts;
+    long chunkStart = start;
+    int chunkCnt = 0;
+    int splitOnSpace = splitsOnSpace(data, start, end);
+
+    for (int i = 1; i <= parts && chunkStart < end; i++)
+    {
+        long chunkEnd = i == parts ? end : start + i * partLen;
+
+        if (chunkEnd < chunkStart)
+            chunkEnd = chunkStart;
+
+        chunkEnd = chunkBoundary(data, chunkEnd, end, splitOnSpace);
+
+        chunks[chunkCnt].data = data;
+        chunks[chunkCnt].start = chunkStart;
+        chunks[chunkCnt].end = chunkEnd;
+        chunkCnt++;
+
+        chunkStart = chunkEnd;
+    }
+
+    return chunkCnt;
+}
+
+// Writes one pixel as a character of the pallette, a line break follows the last pixel of a row
+// Values above gray depth or past the end of the pallette are clamped, pixels past width * height are dropped
+
+static inline void writePixel(pgmChunk* chunk, long index, int value)
+{
+    if (index >= chunk->totalValues)
+        return;
+
+    if (value > chunk->maxValue)
+        value = chunk->maxValue;
+
+    // Values only mode used by streaming, values are stored and converted later
+    if (chunk->values != NULL)
+    {
+        chunk->values[index] = (uint16_t)value;
+
+        return;
+    }
+
+    long row = index / chunk->width;
+    long col = index - row * chunk->width;
+    char* out = chunk->result + row * (chunk->width + 1) + col;
+
+    *out = chunk->pallette[value];
+
+    if (col == chunk->width - 1)
+        out[1] = '\n';
+}
+
+// Pixel text is scanned 64 bytes at a time, every byte gets a bit in a digit mask and in a '#' mask
+// A number starts wherever a digit bit follows a non digit bit, so numbers are counted with popcount
+// and found with count trailing zeros instead of looking at every byte
+
+#ifdef _MSC_VER
+
+#include <intrin.h>
+
+static inline int countTrailingZeros(uint64_t mask)
+{
+    unsigned long index;
+
+    _BitScanForward64(&index, mask);
+
+    return (int)index;
+}
+
+#define popCount(mask) ((int)__popcnt64(mask))
+
+#else
+
+#define countTrailingZeros(mask) __builtin_ctzll(mask)
+#define popCount(mask) __builtin_popcountll(mask)
+
+#endif
+
+#define SCAN_BLOCK 64
+#define MAX_PARSED_VALUE 1000000
+
+// Fills digit and '#' masks for n <= 64 bytes, bits past n stay zero
+
+static inline void classifyBlock(const char* p, int n, uint64_t* digits, uint64_t* hashes)
+{
+    uint64_t digitMask = 0, hashMask = 0;
+    int i = 0;
+
+#if defined(__AVX2__)
+    if (n == SCAN_BLOCK)
+    {
+        __m256i zero = _mm256_set1_epi8('0');
+        __m256i nine = _mm256_set1_epi8(9);
+        __m256i hash = _mm256_set1_epi8('#');
+
+        for (; i < SCAN_BLOCK; i += 32)
+        {
+            __m256i bytes = _mm256_loadu_si256((const __m256i*)(p + i));
+            __m256i value = _mm256_sub_epi8(bytes, zero);
+            __m256i isDigit = _mm256_cmpeq_epi8(_mm256_min_epu8(value, nine), value);
+
+            digitMask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(isDigit) << i;
+            hashMask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, hash)) << i;
+        }
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    if (n == SCAN_BLOCK)
+    {
+        __m128i zero = _mm_set1_epi8('0');
+        __m128i nine = _mm_set1_epi8(9);
+        __m128i hash = _mm_set1_epi8('#');
+
+        for (; i < SCAN_BLOCK; i += 16)
+        {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(p + i));
+            __m128i value = _mm_sub_epi8(bytes, zero);
+            __m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(value, nine), value);
+
+            digitMask |= (uint64_t)(uint16_t)_mm_movemask_epi8(isDigit) << i;
+            hashMask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, hash)) << i;
+        }
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        digitMask |= (uint64_t)((unsigned char)(p[i] - '0') < 10) << i;
+        hashMask |= (uint64_t)(p[i] == '#') << i;
+    }
+
+    *digits = digitMask;
+    *hashes = hashMask;
+}
+
+// Converts len digits at p into a number
+// Up to 8 digits are converted at once inside one 64 bit word: after subtracting '0' from every byte
+// neighbouring digits are combined into pairs, pairs into fours and fours into the result
+// by three multiplications
+
+static inline int parseDigits(const char* p, int len, const char* dataEnd)
+{
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (len <= 8 && p + 8 <= dataEnd)
+    {
+        uint64_t word;
+
+        memcpy(&word, p, 8);
+
+        word -= 0x3030303030303030ULL;
+        word <<= 8 * (8 - len);
+        word = word * 10 + (word >> 8);
+        word = (((word & 0x000000FF000000FFULL) * 0x000F424000000064ULL)
+            + (((word >> 16) & 0x000000FF000000FFULL) * 0x0000271000000001ULL)) >> 32;
+
+        return (int)word;
+    }
+#endif
+
+    int value = 0;
+
+    for (int i = 0; i < len; i++)
+    {
+        value = value * 10 + (p[i] - '0');
+
+        if (value > MAX_PARSED_VALUE)
+            value = MAX_PARSED_VALUE;
+    }
+
+    return value;
+}
+
+// Walks numbers of a chunk, if convert is 0 it only counts them, otherwise writes them as pixels
+// A comment ends the current number, the rest of its line is skipped with memchr
+// Returns number of numbers found
+
+long walkChunk(pgmChunk* chunk, int convert)
+{
+    const char* data = chunk->data;
+    const char* dataEnd = data + chunk->end;
+    long pos = chunk->start;
+    long index = chunk->firstValue;
+    long valueCnt = 0;
+    uint64_t prevDigit = 0;
+
+    while (pos < chunk->end)
+    {
+        int n = chunk->end - pos < SCAN_BLOCK ? (int)(chunk->end - pos) : SCAN_BLOCK;
+        int blockLen = n;
+        uint64_t digits, hashes;
+
+        classifyBlock(data + pos, n, &digits, &hashes);
+
+        if (hashes)
+        {
+            blockLen = countTrailingZeros(hashes);
+            digits &= blockLen == 0 ? 0 : ~0ULL >> (SCAN_BLOCK - blockLen);
+        }
+
+        uint64_t starts = digits & ~((digits << 1) | prevDigit);
+
+        if (!convert)
+            valueCnt += popCount(starts);
+
+        while (convert && starts)
+        {
+            int bit = countTrailingZeros(starts);
+            const char* number = data + pos + bit;
+            int len = countTrailingZeros(~(digits >> bit));
+
+            // Number reaching the end of the block goes on in memory
+            if (bit + len == blockLen)
+            {
+                while (number + len < dataEnd && (unsigned char)(number[len] - '0') < 10)
+                    len++;
+            }
+
+            writePixel(chunk, index++, parseDigits(number, len, dataEnd));
+
+            starts &= starts - 1;
+            valueCnt++;
+        }
+
+        prevDigit = blockLen > 0 ? (digits >> (blockLen - 1)) & 1 : 0;
+
+        if (hashes)
+        {
+            const char* lineEnd = memchr(data + pos + blockLen, '\n', chunk->end - pos - blockLen);
+
+            pos = lineEnd != NULL ? lineEnd - data + 1 : chunk->end;
+            prevDigit = 0;
+        }
+        else
+            pos += n;
+    }
+
+    return valueCnt;
+}
+
+// Counts numbers in a chunk, first pass so that every chunk knows where its pixels start
+
+THREAD_FUNC countChunkValues(void* args)
+{
+    pgmChunk* chunk = args;
+
+    chunk->valueCnt = walkChunk(chunk, 0);
+
+    THREAD_RETURN;
+}
+
+// Second pass, converts numbers of a chunk and writes them straight into the shared result
+
+THREAD_FUNC convertChunk(void* args)
+{
+    walkChunk(args, 1);
+
+    THREAD_RETURN;
+}
+
+// Binary P5 data is converted by row bands, one band per thread
+
+typedef struct
+{
+    unsigned char* pixels;
+    int firstRow;
+    int lastRow;
+    int width;
+    int bytesPerPixel;
+    unsigned char* lut;
+    char* result;
+} pgmBand;
+
+#ifdef PSHUFB_DISPATCH
+
+// Best pshufb kernel the CPU runs, 2 for AVX2, 1 for SSSE3 and 0 for none
+// Found on first use, threads racing here all store the same value
+
+int pshufbLevel()
+{
+    static int level = -1;
+
+    if (level >= 0)
+        return level;
+
+#ifdef _MSC_VER
+    int info[4];
+
+    __cpuid(info, 1);
+
+    int ssse3 = (info[2] >> 9) & 1;
+    int osSavesAvx = ((info[2] >> 27) & 1) && (_xgetbv(0) & 6) == 6;
+
+    __cpuidex(info, 7, 0);
+
+    level = osSavesAvx && ((info[1] >> 5) & 1) ? 2 : ssse3;
+#else
+    level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("ssse3") ? 1 : 0;
+#endif
+
+    return level;
+}
+
+// Translates every byte of src through a 256 entry table
+// The table is split into 16 rows of 16 characters, pshufb looks up the low nibble in every row
+// and a compare on the high nibble picks the right one
+// Returns how many bytes were translated, the rest is shorter than one vector
+
+TARGET_AVX2 long translateBytesAvx2(const unsigned char* src, char* dst, long len, const unsigned char* lut)
+{
+    long i = 0;
+    __m256i lowNibble = _mm256_set1_epi8(0x0F);
+    __m256i tables[16];
+
+    for (int k = 0; k < 16; k++)
+        tables[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(lut + 16 * k)));
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i low = _mm256_and_si256(bytes, lowNibble);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), lowNibble);
+        __m256i out = _mm256_setzero_si256();
+
+        for (int k = 0; k < 16; k++)
+        {
+            __m256i hit = _mm256_cmpeq_epi8(high, _mm256_set1_epi8((char)k));
+
+            out = _mm256_or_si256(out, _mm256_and_si256(_mm256_shuffle_epi8(tables[k], low), hit));
+        }
+
+        _mm256_storeu_si256((__m256i*)(dst + i), out);
+    }
+
+    return i;
+}
+
+TARGET_SSSE3 long translateBytesSsse3(const unsigned char* src, char* dst, long len, const unsigned char* lut)
+{
+    long i = 0;
+    __m128i lowNibble = _mm_set1_epi8(0x0F);
+    __m128i tables[16];
+
+    for (int k = 0; k < 16; k++)
+        tables[k] = _mm_loadu_si128((const __m128i*)(lut + 16 * k));
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i low = _mm_and_si128(bytes, lowNibble);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), lowNibble);
+        __m128i out = _mm_setzero_si128();
+
+        for (int k = 0; k < 16; k++)
+        {
+            __m128i hit = _mm_cmpeq_epi8(high, _mm_set1_epi8((char)k));
+
+            out = _mm_or_si128(out, _mm_and_si128(_mm_shuffle_epi8(tables[k], low), hit));
+        }
+
+        _mm_storeu_si128((__m128i*)(dst + i), out);
+    }
+
+    return i;
+}
+
+#endif
+
+// Translates every byte of src through a 256 entry table with the best kernel the CPU has
+
+void translateBytes(const unsigned char* src, char* dst, long len, const unsigned char* lut)
+{
+    long i = 0;
+
+#ifdef PSHUFB_DISPATCH
+    int level = pshufbLevel();
+
+    if (level == 2)
+        i = translateBytesAvx2(src, dst, len, lut);
+    else if (level == 1)
+        i = translateBytesSsse3(src, dst, len, lut);
+#endif
+
+    for (; i < len; i++)
+        dst[i] = (char)lut[src[i]];
+}
+
+THREAD_FUNC convertBand(void* args)
+{
+    pgmBand* band = args;
+
+    for (int row = band->firstRow; row < band->lastRow; row++)
+    {
+        unsigned char* src = band->pixels + (size_t)row * band->width * band->bytesPerPixel;
+        char* dst = band->result + (size_t)row * (band->width + 1);
+
+        if (band->bytesPerPixel == 1)
+            translateBytes(src, dst, band->width, band->lut);
+
+        // 16 bit samples are big endian
+        else
+        {
+            for (int col = 0; col < band->width; col++)
+                dst[col] = (char)band->lut[(src[2 * col] << 8) | src[2 * col + 1]];
+        }
+
+        dst[band->width] = '\n';
+    }
+
+    THREAD_RETURN;
+}
+
+// Converts binary P5 pixels, gray depth below 256 means one byte per pixel, otherwise two
+// Every possible sample value is mapped to a character up front so a pixel is a single lookup
+// Returns NULL if the file is shorter than width * height pixels
+
+char* convertBinaryPixels(pgmImage img, long dataStart, int maxValue, char* pallette, int threadCnt, char* result)
+{
+    pgmBand bands[MAX_THREADS];
+    int bytesPerPixel = img.depth < 256 ? 1 : 2;
+    size_t lutLen = bytesPerPixel == 1 ? 256 : 65536;
+
+    if (img.dataLen - dataStart < (long)img.width * img.height * bytesPerPixel)
+    {
+        printf("File has less pixel data than width * height!\n");
+
+        return NULL;
+    }
+
+    unsigned char* lut = (unsigned char*)malloc(lutLen);
+    int ownResult = result == NULL;
+
+    if (ownResult)
+        result = (char*)malloc((size_t)(img.width + 1) * img.height);
+
+    if (lut == NULL || result == NULL)
+    {
+        free(lut);
+
+        if (ownResult)
+            free(result);
+
+        return NULL;
+    }
+
+    for (size_t v = 0; v < lutLen; v++)
+        lut[v] = (unsigned char)pallette[(int)v > maxValue ? maxValue : (int)v];
+
+    if (threadCnt > img.height)
+        threadCnt = img.height > 0 ? img.height : 1;
+
+    for (int i = 0; i < threadCnt; i++)
+    {
+        bands[i].pixels = (unsigned char*)img.data + dataStart;
+        bands[i].firstRow = (int)((long)img.height * i / threadCnt);
+        bands[i].lastRow = (int)((long)img.height * (i + 1) / threadCnt);
+        bands[i].width = img.width;
+        bands[i].bytesPerPixel = bytesPerPixel;
+        bands[i].lut = lut;
+        bands[i].result = result;
+    }
+
+    runThreads(convertBand, bands, sizeof(pgmBand), threadCnt);
+
+    free(lut);
+
+    return result;
+}
+
+// Tone mapping and dithering
+// Every gray value gets a position in the pallette in 1/256 steps of a character, so pallettes of
+// any length work, values are scaled to the whole pallette and gamma or histogram equalization
+// only change that table
+// Without dithering a position is rounded to the nearest character, ordered dithering adds an
+// 8x8 Bayer threshold and Floyd-Steinberg pushes the rounding error on to the next pixels
+
+#define DITHER_NONE 0
+#define DITHER_ORDERED 1
+#define DITHER_FLOYD 2
+
+// Pixels of a row done before progress is published to the next row
+#define DIFFUSE_BLOCK 64
+
+typedef struct
+{
+    char* pallette;
+    double gamma;
+    int equalize;
+    int dither;
+} toneOptions;
+
+typedef struct
+{
+    char* pallette;
+    int palletteLen;
+    int depth;
+    int dither;
+    int* levels;
+    char* chars;
+} pgmQuantizer;
+
+static const unsigned char bayerMatrix[8][8] =
+{
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+void quantizerFree(pgmQuantizer* q)
+{
+    free(q->levels);
+    free(q->chars);
+}
+
+// Builds the value tables for gray depth, histogram has depth + 1 counts and is only needed
+// for equalization
+// Returns 0 on success
+
+int quantizerInit(pgmQuantizer* q, toneOptions* tone, int depth, const uint64_t* histogram)
+{
+    q->pallette = tone->pallette;
+    q->palletteLen = (int)strlen(tone->pallette);
+    q->depth = depth;
+    q->dither = tone->dither;
+    q->levels = (int*)malloc((depth + 1) * sizeof(int));
+    q->chars = (char*)malloc(depth + 1);
+
+    if (q->levels == NULL || q->chars == NULL || q->palletteLen == 0)
+    {
+        quantizerFree(q);
+
+        return 1;
+    }
+
+    int top = q->palletteLen - 1;
+    uint64_t total = 0, lowest = 0, below = 0;
+
+    // Equalization maps the cumulative histogram, starting at the darkest value that is present
+    if (tone->equalize && histogram != NULL)
+    {
+        for (int v = 0; v <= depth; v++)
+        {
+            if (total == 0)
+                lowest = histogram[v];
+
+            total += histogram[v];
+        }
+    }
+
+    int equalize = total > lowest;
+
+    for (int v = 0; v <= depth; v++)
+    {
+        long long level;
+
+        if (!equalize && tone->gamma == 1.0)
+            level = depth > 0 ? ((long long)v * top * 512 + depth) / (2 * (long long)depth) : 0;
+        else
+        {
+            double x = depth > 0 ? (double)v / depth : 0;
+
+            if (equalize)
+            {
+                below += histogram[v];
+                x = below > lowest ? (double)(below - lowest) / (total - lowest) : 0;
+            }
+
+            if (tone->gamma != 1.0)
+                x = pow(x, 1.0 / tone->gamma);
+
+            level = (long long)(x * top * 256 + 0.5);
+        }
+
+        int index = (int)((level + 128) >> 8);
+
+        q->levels[v] = (int)level;
+        q->chars[v] = q->pallette[index > top ? top : index];
+    }
+
+    return 0;
+}
+
+// Converts pixels first to last of row y
+// Error diffusion reads the error of this row from errIn and adds error for the next row to errOut,
+// both are width + 2 long with pixel x at x + 1, carry holds the error passed to the right
+
+static inline void quantizeSpan(pgmQuantizer* q, const uint16_t* values, int first, int last, int y, char* out, int* errIn, int* errOut, int* carry)
+{
+    int top = q->palletteLen - 1;
+
+    if (q->dither == DITHER_NONE)
+    {
+        for (int x = first; x < last; x++)
+            out[x] = q->chars[values[x]];
+    }
+    else if (q->dither == DITHER_ORDERED)
+    {
+        const unsigned char* thresholds = bayerMatrix[y & 7];
+
+        for (int x = first; x < last; x++)
+        {
+            int index = (q->levels[values[x]] + thresholds[x & 7] * 4 + 2) >> 8;
+
+            out[x] = q->pallette[index > top ? top : index];
+        }
+    }
+    else
+    {
+        int error = *carry;
+
+        for (int x = first; x < last; x++)
+        {
+            int wanted = q->levels[values[x]] + errIn[x + 1] + error;
+            int index = wanted < 0 ? 0 : (wanted + 128) >> 8;
+
+            if (index > top)
+                index = top;
+
+            out[x] = q->pallette[index];
+
+            // 7/16 right, 3/16 down left, 5/16 down and the rest down right
+            int rest = wanted - index * 256;
+            int downLeft = rest * 3 / 16;
+            int down = rest * 5 / 16;
+
+            error = rest * 7 / 16;
+            errOut[x] += downLeft;
+            errOut[x + 1] += down;
+            errOut[x + 2] += rest - error - downLeft - down;
+        }
+
+        *carry = error;
+    }
+}
+
+// Converts a whole row and ends it with a line break, see quantizeSpan
+
+void quantizeRow(pgmQuantizer* q, const uint16_t* values, int width, int y, char* out, int* errIn, int* errOut)
+{
+    int carry = 0;
+
+    quantizeSpan(q, values, 0, width, y, out, errIn, errOut, &carry);
+
+    out[width] = '\n';
+}
+
+// Rows of a whole image quantized in parallel
+// Without error diffusion rows are independent and every thread takes a band of rows
+// Error diffusion runs as a wavefront, threads take the next row and follow the row above
+// DIFFUSE_BLOCK pixels at a time, pixel x needs the row above to be done up to x + 1
+// Rows finish in order, so with n threads a ring of n + 1 error rows is enough
+
+typedef struct
+{
+    pgmQuantizer* q;
+    const uint16_t* values;
+    int width;
+    int height;
+    int firstRow;
+    int lastRow;
+    int ringSize;
+    int* errRows;
+    int* progress;
+    int* nextRow;
+    char* result;
+} pgmQuantizeBand;
+
+THREAD_FUNC quantizeBand(void* args)
+{
+    pgmQuantizeBand* band = args;
+
+    for (int y = band->firstRow; y < band->lastRow; y++)
+        quantizeRow(band->q, band->values + (size_t)y * band->width, band->width, y, band->result + (size_t)y * (band->width + 1), NULL, NULL);
+
+    THREAD_RETURN;
+}
+
+THREAD_FUNC diffuseRows(void* args)
+{
+    pgmQuantizeBand* band = args;
+    int width = band->width;
+    int y;
+
+    while ((y = atomicAddInt(band->nextRow, 1)) < band->height)
+    {
+        const uint16_t* values = band->values + (size_t)y * width;
+        char* out = band->result + (size_t)y * (width + 1);
+        int* errIn = band->errRows + (size_t)(y % band->ringSize) * (width + 2);
+        int* errOut = band->errRows + (size_t)((y + 1) % band->ringSize) * (width + 2);
+        int carry = 0;
+
+        memset(errOut, 0, (width + 2) * sizeof(int));
+
+        for (int x = 0; x < width; x += DIFFUSE_BLOCK)
+        {
+            int last = x + DIFFUSE_BLOCK < width ? x + DIFFUSE_BLOCK : width;
+            int needed = last + 1 < width ? last + 1 : width;
+
+            while (y > 0 && atomicLoadInt(&band->progress[y - 1]) < needed)
+                yieldThread();
+
+            quantizeSpan(band->q, values, x, last, y, out, errIn, errOut, &carry);
+
+            atomicStoreInt(&band->progress[y], last);
+        }
+
+        out[width] = '\n';
+    }
+
+    THREAD_RETURN;
+}
+
+// Writes width x height values as characters with line breaks into result
+// Returns 0 on success
+
+int quantizeImage(pgmQuantizer* q, const uint16_t* values, int width, int height, char* result, int threadCnt)
+{
+    pgmQuantizeBand bands[MAX_THREADS];
+    int* errRows = NULL;
+    int* progress = NULL;
+    int nextRow = 0;
+
+    if (threadCnt > height)
+        threadCnt = height;
+
+    if (threadCnt < 1)
+        threadCnt = 1;
+
+    if (q->dither == DITHER_FLOYD)
+    {
+        errRows = (int*)calloc((size_t)(threadCnt + 1) * (width + 2), sizeof(int));
+        progress = (int*)calloc(height, sizeof(int));
+
+        if (errRows == NULL || progress == NULL)
+        {
+            free(errRows);
+            free(progress);
+
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < threadCnt; i++)
+    {
+        bands[i].q = q;
+        bands[i].values = values;
+        bands[i].width = width;
+        bands[i].height = height;
+        bands[i].firstRow = (int)((long)height * i / threadCnt);
+        bands[i].lastRow = (int)((long)height * (i + 1) / threadCnt);
+        bands[i].ringSize = threadCnt + 1;
+        bands[i].errRows = errRows;
+        bands[i].progress = progress;
+        bands[i].nextRow = &nextRow;
+        bands[i].result = result;
+    }
+
+    runThreads(q->dither == DITHER_FLOYD ? diffuseRows : quantizeBand, bands, sizeof(pgmQuantizeBand), threadCnt);
+
+    free(errRows);
+    free(progress);
+
+    return 0;
+}
+
+// Downscaling by area averaging, every output pixel is the mean of the source area it covers
+// The filter is separable, a source row is first reduced to output width and then added to the
+// output rows it overlaps, so only two output rows of sums are live at any time
+// Coordinates are scaled so that a source pixel is dstWidth units wide and an output pixel srcWidth
+// units, overlaps are then whole numbers and no rounding is done until the final division
+
+// Character cells are about twice as tall as wide
+#define CHAR_ASPECT 0.5
+
+typedef struct
+{
+    int srcWidth;
+    int srcHeight;
+    int dstWidth;
+    int dstHeight;
+    int firstRow;
+    int lastRow;
+    int accRow;
+    int readyRow;
+    int* colIndex;
+    uint32_t* colWeight;
+    uint64_t* rowSums;
+    uint64_t* acc[2];
+    uint16_t* outRow;
+} pgmScaler;
+
+// Picks output size from requested columns and rows, 0 means derived from the other one keeping
+// aspect ratio, both 0 keeps the source size. Images are never scaled up
+
+void getTargetSize(int width, int height, int columns, int rows, int* dstWidth, int* dstHeight)
+{
+    *dstWidth = width;
+    *dstHeight = height;
+
+    if (width <= 0 || height <= 0)
+        return;
+
+    if (columns > 0 && rows > 0)
+    {
+        *dstWidth = columns;
+        *dstHeight = rows;
+    }
+    else if (columns > 0)
+    {
+        *dstWidth = columns;
+        *dstHeight = (int)((double)height * columns / width * CHAR_ASPECT + 0.5);
+    }
+    else if (rows > 0)
+    {
+        *dstHeight = rows;
+        *dstWidth = (int)((double)width * rows / height / CHAR_ASPECT + 0.5);
+    }
+
+    if (*dstWidth > width)
+        *dstWidth = width;
+
+    if (*dstHeight > height)
+        *dstHeight = height;
+
+    if (*dstWidth < 1)
+        *dstWidth = 1;
+
+    if (*dstHeight < 1)
+        *dstHeight = 1;
+}
+
+void scalerFree(pgmScaler* scaler)
+{
+    free(scaler->colIndex);
+    free(scaler->colWeight);
+    free(scaler->rowSums);
+    free(scaler->acc[0]);
+    free(scaler->acc[1]);
+    free(scaler->outRow);
+}
+
+// Prepares a scaler producing output rows firstRow to lastRow
+// Returns 0 on success
+
+int scalerInit(pgmScaler* scaler, int srcWidth, int srcHeight, int dstWidth, int dstHeight, int firstRow, int lastRow)
+{
+    memset(scaler, 0, sizeof(pgmScaler));
+
+    scaler->srcWidth = srcWidth;
+    scaler->srcHeight = srcHeight;
+    scaler->dstWidth = dstWidth;
+    scaler->dstHeight = dstHeight;
+    scaler->firstRow = firstRow;
+    scaler->lastRow = lastRow;
+    scaler->accRow = -1;
+
+    // rowSums has one extra column so the spill of the last source pixel, which always has weight 0, needs no check
+    scaler->colIndex = (int*)malloc(srcWidth * sizeof(int));
+    scaler->colWeight = (uint32_t*)malloc(srcWidth * sizeof(uint32_t));
+    scaler->rowSums = (uint64_t*)malloc((dstWidth + 1) * sizeof(uint64_t));
+    scaler->acc[0] = (uint64_t*)calloc(dstWidth, sizeof(uint64_t));
+    scaler->acc[1] = (uint64_t*)calloc(dstWidth, sizeof(uint64_t));
+    scaler->outRow = (uint16_t*)malloc(dstWidth * sizeof(uint16_t));
+
+    if (!scaler->colIndex || !scaler->colWeight || !scaler->rowSums || !scaler->acc[0] || !scaler->acc[1] || !scaler->outRow)
+    {
+        scalerFree(scaler);
+
+        return 1;
+    }
+
+    // A source pixel overlaps at most two output pixels, the first gets colWeight and the next the rest
+    for (int x = 0; x < srcWidth; x++)
+    {
+        uint64_t left = (uint64_t)x * dstWidth;
+        uint64_t right = left + dstWidth;
+        int col = (int)(left / srcWidth);
+        uint64_t colEnd = (uint64_t)(col + 1) * srcWidth;
+
+        scaler->colIndex[x] = col;
+        scaler->colWeight[x] = (uint32_t)((right < colEnd ? right : colEnd) - left);
+    }
+
+    return 0;
+}
+
+// Adds source row y, rows have to come in order
+// Returns 1 when output row readyRow is complete, its values are in outRow
+
+int scalerAddRow(pgmScaler* scaler, int y, const uint16_t* values)
+{
+    uint64_t* rowSums = scaler->rowSums;
+    uint64_t top = (uint64_t)y * scaler->dstHeight;
+    uint64_t bottom = top + scaler->dstHeight;
+    int row = (int)(top / scaler->srcHeight);
+    uint64_t rowEnd = (uint64_t)(row + 1) * scaler->srcHeight;
+    uint64_t weight = (bottom < rowEnd ? bottom : rowEnd) - top;
+    uint64_t spill = scaler->dstHeight - weight;
+
+    if (scaler->accRow < 0)
+        scaler->accRow = row;
+
+    memset(rowSums, 0, (scaler->dstWidth + 1) * sizeof(uint64_t));
+
+    for (int x = 0; x < scaler->srcWidth; x++)
+    {
+        uint64_t value = values[x];
+        uint32_t colWeight = scaler->colWeight[x];
+        int col = scaler->colIndex[x];
+
+        rowSums[col] += value * colWeight;
+        rowSums[col + 1] += value * (scaler->dstWidth - colWeight);
+    }
+
+    if (row >= scaler->firstRow && row < scaler->lastRow)
+    {
+        for (int col = 0; col < scaler->dstWidth; col++)
+            scaler->acc[0][col] += rowSums[col] * weight;
+    }
+
+    if (spill > 0 && row + 1 >= scaler->firstRow && row + 1 < scaler->lastRow)
+    {
+        for (int col = 0; col < scaler->dstWidth; col++)
+            scaler->acc[1][col] += rowSums[col] * spill;
+    }
+
+    // Row is complete once the source row reaches its bottom edge
+    if (bottom < rowEnd)
+        return 0;
+
+    uint64_t area = (uint64_t)scaler->srcWidth * scaler->srcHeight;
+    uint64_t* done = scaler->acc[0];
+
+    for (int col = 0; col < scaler->dstWidth; col++)
+        scaler->outRow[col] = (uint16_t)((done[col] + area / 2) / area);
+
+    memset(done, 0, scaler->dstWidth * sizeof(uint64_t));
+
+    scaler->acc[0] = scaler->acc[1];
+    scaler->acc[1] = done;
+    scaler->readyRow = scaler->accRow++;
+
+    return scaler->readyRow >= scaler->firstRow && scaler->readyRow < scaler->lastRow;
+}
+
+// Reads P2 pixels row by row from any value on, so scaling never holds more than a piece of text
+// worth of values. Counted chunks tell where to start, the text is then parsed in pieces that end
+// where a chunk could end, so no number or comment is cut
+
+#define TEXT_PIECE (64 * 1024)
+
+typedef struct
+{
+    const char* data;
+    long end;
+    long pos;
+    int splitOnSpace;
+    int maxValue;
+    uint16_t* values;
+    long capacity;
+    long valueCnt;
+    long next;
+} pgmTextRows;
+
+// Parses the next piece into values, with convert 0 the numbers are only counted
+// Returns number of numbers in the piece, -1 if out of memory
+
+long textRowsPiece(pgmTextRows* reader, int convert)
+{
+    long pieceEnd = reader->end - reader->pos > TEXT_PIECE
+        ? chunkBoundary(reader->data, reader->pos + TEXT_PIECE, reader->end, reader->splitOnSpace) : reader->end;
+
+    // Every number takes at least one digit and one separator
+    long maxValues = (pieceEnd - reader->pos + 1) / 2;
+
+    if (convert && maxValues > reader->capacity)
+    {
+        uint16_t* values = (uint16_t*)realloc(reader->values, maxValues * sizeof(uint16_t));
+
+        if (values == NULL)
+            return -1;
+
+        reader->values = values;
+        reader->capacity = maxValues;
+    }
+
+    pgmChunk piece;
+
+    memset(&piece, 0, sizeof(piece));
+
+    piece.data = (char*)reader->data;
+    piece.start = reader->pos;
+    piece.end = pieceEnd;
+    piece.totalValues = maxValues;
+    piece.maxValue = reader->maxValue;
+    piece.values = reader->values;
+
+    reader->pos = pieceEnd;
+
+    return walkChunk(&piece, convert);
+}
+
+// Positions the reader on value first, chunks have to be counted by countTextPixels
+// Returns 0 on success
+
+int textRowsInit(pgmTextRows* reader, const pgmChunk* chunks, int chunkCnt, int splitOnSpace, int maxValue, long first)
+{
+    int c = 0;
+
+    while (c + 1 < chunkCnt && chunks[c].firstValue + chunks[c].valueCnt <= first)
+        c++;
+
+    memset(reader, 0, sizeof(pgmTextRows));
+
+    reader->data = chunks[c].data;
+    reader->end = chunks[chunkCnt - 1].end;
+    reader->pos = chunks[c].start;
+    reader->splitOnSpace = splitOnSpace;
+    reader->maxValue = maxValue;
+
+    // Pieces before the first value are only counted, the one holding it is converted
+    long index = chunks[c].firstValue;
+
+    while (reader->pos < reader->end)
+    {
+        long start = reader->pos;
+        long count = textRowsPiece(reader, 0);
+
+        if (index + count > first)
+        {
+            reader->pos = start;
+            reader->valueCnt = textRowsPiece(reader, 1);
+            reader->next = first - index;
+
+            return reader->valueCnt < 0;
+        }
+
+        index += count;
+    }
+
+    return 1;
+}
+
+// Copies the next width values into row
+// Returns 0 on success, 1 if the text ran out or memory did
+
+int textRowsRead(pgmTextRows* reader, uint16_t* row, int width)
+{
+    int filled = 0;
+
+    while (filled < width)
+    {
+        if (reader->next == reader->valueCnt)
+        {
+            if (reader->pos >= reader->end || (reader->valueCnt = textRowsPiece(reader, 1)) < 0)
+                return 1;
+
+            reader->next = 0;
+
+            continue;
+        }
+
+        long count = reader->valueCnt - reader->next;
+
+        if (count > width - filled)
+            count = width - filled;
+
+        memcpy(row + filled, reader->values + reader->next, count * sizeof(uint16_t));
+
+        filled += (int)count;
+        reader->next += count;
+    }
+
+    return 0;
+}
+
+// Scaled images are split into bands of output rows, every thread reads the source rows
+// its band overlaps, pixels come either from P2 text or straight from P5 data
+// Output rows are written as characters or, if dstValues is set, as values
+
+typedef struct
+{
+    const pgmChunk* chunks;
+    int chunkCnt;
+    int splitOnSpace;
+    const unsigned char* pixels;
+    int bytesPerPixel;
+    int srcWidth;
+    int srcHeight;
+    int dstWidth;
+    int dstHeight;
+    int firstRow;
+    int lastRow;
+    int maxValue;
+    char* pallette;
+    char* result;
+    uint16_t* dstValues;
+    int failed;
+} pgmScaleBand;
+
+THREAD_FUNC scaleBand(void* args)
+{
+    pgmScaleBand* band = args;
+    pgmScaler scaler;
+    uint16_t* rowValues = NULL;
+
+    if (band->firstRow >= band->lastRow)
+        THREAD_RETURN;
+
+    if (scalerInit(&scaler, band->srcWidth, band->srcHeight, band->dstWidth, band->dstHeight, band->firstRow, band->lastRow))
+    {
+        band->failed = 1;
+
+        THREAD_RETURN;
+    }
+
+    int firstSrcRow = (int)((uint64_t)band->firstRow * band->srcHeight / band->dstHeight);
+    int lastSrcRow = (int)(((uint64_t)band->lastRow * band->srcHeight + band->dstHeight - 1) / band->dstHeight);
+    pgmTextRows reader;
+
+    memset(&reader, 0, sizeof(reader));
+
+    if ((rowValues = (uint16_t*)malloc(band->srcWidth * sizeof(uint16_t))) == NULL
+        || (band->chunks != NULL && textRowsInit(&reader, band->chunks, band->chunkCnt, band->splitOnSpace, band->maxValue,
+            (long)firstSrcRow * band->srcWidth)))
+    {
+        free(reader.values);
+        free(rowValues);
+        scalerFree(&scaler);
+        band->failed = 1;
+
+        THREAD_RETURN;
+    }
+
+    for (int y = firstSrcRow; y < lastSrcRow; y++)
+    {
+        if (band->chunks != NULL)
+        {
+            if (textRowsRead(&reader, rowValues, band->srcWidth))
+            {
+                band->failed = 1;
+
+                break;
+            }
+        }
+        else
+        {
+            const unsigned char* src = band->pixels + (size_t)y * band->srcWidth * band->bytesPerPixel;
+
+            for (int x = 0; x < band->srcWidth; x++)
+            {
+                int value = band->bytesPerPixel == 1 ? src[x] : (src[2 * x] << 8) | src[2 * x + 1];
+
+                rowValues[x] = (uint16_t)(value > band->maxValue ? band->maxValue : value);
+            }
+        }
+
+        if (!scalerAddRow(&scaler, y, rowValues))
+            continue;
+
+        if (band->dstValues != NULL)
+            memcpy(band->dstValues + (size_t)scaler.readyRow * band->dstWidth, scaler.outRow, band->dstWidth * sizeof(uint16_t));
+        else
+        {
+            char* dst = band->result + (size_t)scaler.readyRow * (band->dstWidth + 1);
+
+            for (int col = 0; col < band->dstWidth; col++)
+                dst[col] = band->pallette[scaler.outRow[col]];
+
+            dst[band->dstWidth] = '\n';
+        }
+    }
+
+    free(reader.values);
+    free(rowValues);
+    scalerFree(&scaler);
+
+    THREAD_RETURN;
+}
+
+// First pass over P2 pixel data, every thread counts numbers in its chunk, then a prefix sum
+// over the counts tells every chunk where its pixels start
+// Returns number of chunks, total gets the number of values found
+
+int countTextPixels(pgmImage img, long dataStart, int threadCnt, pgmChunk* chunks, long* total)
+{
+    int chunkCnt = splitPixelData(img.data, dataStart, img.dataLen, threadCnt, chunks);
+
+    runThreads(countChunkValues, chunks, sizeof(pgmChunk), chunkCnt);
+
+    *total = 0;
+
+    for (int i = 0; i < chunkCnt; i++)
+    {
+        chunks[i].firstValue = *total;
+        *total += chunks[i].valueCnt;
+    }
+
+    return chunkCnt;
+}
+
+// Parses P2 pixel data in parallel, the second pass writes every chunk's pixels as characters to result
+// Returns number of values found, which can be more or less than width * height
+
+long parseTextPixels(pgmImage img, long dataStart, int maxValue, char* pallette, char* result, int threadCnt)
+{
+    pgmChunk chunks[MAX_THREADS];
+    long total;
+    int chunkCnt = countTextPixels(img, dataStart, threadCnt, chunks, &total);
+
+    for (int i = 0; i < chunkCnt; i++)
+    {
+        chunks[i].width = img.width;
+        chunks[i].totalValues = (long)img.width * img.height;
+        chunks[i].maxValue = maxValue;
+        chunks[i].pallette = pallette;
+        chunks[i].result = result;
+        chunks[i].values = NULL;
+    }
+
+    runThreads(convertChunk, chunks, sizeof(pgmChunk), chunkCnt);
+
+    return total;
+}
+
+// Scales the image down to dstWidth x dstHeight, see pgmScaler
+// Rows are written to result as characters of chars, or to dstValues as values if that is not NULL
+// Returns 0 on success
+
+int scaleImage(pgmImage img, long dataStart, char* chars, int threadCnt, int dstWidth, int dstHeight, char* result, uint16_t* dstValues)
+{
+    pgmScaleBand bands[MAX_THREADS];
+    pgmChunk chunks[MAX_THREADS];
+    int chunkCnt = 0, splitOnSpace = 0;
+    int bytesPerPixel = img.depth < 256 ? 1 : 2;
+    int failed = 0;
+
+    if (img.format == 5 && img.dataLen - dataStart < (long)img.width * img.height * bytesPerPixel)
+    {
+        printf("File has less pixel data than width * height!\n");
+
+        return 1;
+    }
+
+    // Text pixels are counted first so every band knows where its rows start
+    if (img.format == 2)
+    {
+        long total;
+
+        chunkCnt = countTextPixels(img, dataStart, threadCnt, chunks, &total);
+        splitOnSpace = splitsOnSpace(img.data, dataStart, img.dataLen);
+
+        if (total < (long)img.width * img.height)
+        {
+            printf("File has less pixel data than width * height!\n");
+
+            return 1;
+        }
+    }
+
+    if (threadCnt > dstHeight)
+        threadCnt = dstHeight;
+
+    for (int i = 0; i < threadCnt; i++)
+    {
+        bands[i].chunks = img.format == 2 ? chunks : NULL;
+        bands[i].chunkCnt = chunkCnt;
+        bands[i].splitOnSpace = splitOnSpace;
+        bands[i].pixels = (unsigned char*)img.data + dataStart;
+        bands[i].bytesPerPixel = bytesPerPixel;
+        bands[i].srcWidth = img.width;
+        bands[i].srcHeight = img.height;
+        bands[i].dstWidth = dstWidth;
+        bands[i].dstHeight = dstHeight;
+        bands[i].firstRow = (int)((long)dstHeight * i / threadCnt);
+        bands[i].lastRow = (int)((long)dstHeight * (i + 1) / threadCnt);
+        bands[i].maxValue = img.depth;
+        bands[i].pallette = chars;
+        bands[i].result = result;
+        bands[i].dstValues = dstValues;
+        bands[i].failed = 0;
+    }
+
+    runThreads(scaleBand, bands, sizeof(pgmScaleBand), threadCnt);
+
+    for (int i = 0; i < threadCnt; i++)
+        failed |= bands[i].failed;
+
+    return failed;
+}
+
+// Equalization and dithering need the values of the whole output image first, they are gathered
+// with the scaler, which copies values unchanged when the size stays the same
+// Returns 0 on success
+
+int quantizeScaledImage(pgmImage img, long dataStart, toneOptions* tone, int threadCnt, int dstWidth, int dstHeight, char* result)
+{
+    pgmQuantizer q;
+    uint64_t* histogram = NULL;
+    uint16_t* values = (uint16_t*)malloc((size_t)dstWidth * dstHeight * sizeof(uint16_t));
+    int failed = values == NULL || scaleImage(img, dataStart, NULL, threadCnt, dstWidth, dstHeight, NULL, values);
+
+    if (!failed && tone->equalize)
+    {
+        histogram = (uint64_t*)calloc(img.depth + 1, sizeof(uint64_t));
+        failed = histogram == NULL;
+
+        for (size_t i = 0; !failed && i < (size_t)dstWidth * dstHeight; i++)
+            histogram[values[i]]++;
+    }
+
+    if (!failed && (failed = quantizerInit(&q, tone, img.depth, histogram)) == 0)
+    {
+        failed = quantizeImage(&q, values, dstWidth, dstHeight, result, threadCnt);
+
+        quantizerFree(&q);
+    }
+
+    free(histogram);
+    free(values);
+
+    return failed;
+}
+
+// Converts pixel values to ascii characters of the pallette in tone, see toneOptions
+// Output is dstWidth x dstHeight, smaller sizes than the image are area averaged
+// result has to hold (dstWidth + 1) * dstHeight characters, if it is NULL the buffer is allocated
+// The header of img has to be checked with pgmParse, as getPgmFile does
+
+char* createASCIIArt(pgmImage img, toneOptions* tone, int threadCnt, int dstWidth, int dstHeight, char* result)
+{
+    long dataStart = img.dataStart;
+    int ownResult = result == NULL;
+    int failed = 0;
+    pgmQuantizer q;
+
+    if (threadCnt < 1)
+        threadCnt = 1;
+
+    if (threadCnt > MAX_THREADS)
+        threadCnt = MAX_THREADS;
+
+    if (ownResult)
+        result = (char*)malloc((size_t)(dstWidth + 1) * dstHeight);
+
+    if (result == NULL)
+        return NULL;
+
+    if (tone->equalize || tone->dither != DITHER_NONE)
+        failed = quantizeScaledImage(img, dataStart, tone, threadCnt, dstWidth, dstHeight, result);
+
+    // Otherwise every value maps to one character and the table replaces the pallette
+    else if ((failed = quantizerInit(&q, tone, img.depth, NULL)) == 0)
+    {
+        if (dstWidth != img.width || dstHeight != img.height)
+            failed = scaleImage(img, dataStart, q.chars, threadCnt, dstWidth, dstHeight, result, NULL);
+        else if (img.format == 5)
+            failed = convertBinaryPixels(img, dataStart, img.depth, q.chars, threadCnt, result) == NULL;
+        else if (parseTextPixels(img, dataStart, img.depth, q.chars, result, threadCnt) < (long)img.width * img.height)
+        {
+            printf("File has less pixel data than width * height!\n");
+
+            failed = 1;
+        }
+
+        quantizerFree(&q);
+    }
+
+    if (failed && ownResult)
+        free(result);
+
+    return failed ? NULL : result;
+}
+
+// Streaming conversion, the input is read in windows and the output is written by a writer thread
+// or an io_uring while the next rows are converted, so memory use does not depend on image size
+
+#define STREAM_WINDOW (1 << 20)
+#define STREAM_OUT_BLOCK (1 << 20)
+#define STREAM_OUT_BUFFERS 4
+
+// Ring of output blocks, the converter fills blocks[head] while the writer writes the queued ones
+// With the uring backend there is no writer thread, blocks are queued on the ring directly and
+// pending tells when a block can be filled again
+
+typedef struct
+{
+    char* blocks[STREAM_OUT_BUFFERS];
+    size_t lens[STREAM_OUT_BUFFERS];
+    int pending[STREAM_OUT_BUFFERS];
+    size_t blockSize;
+    size_t fill;
+    int head;
+    int tail;
+    int queued;
+    int done;
+    int threaded;
+    outputFile* out;
+    syncPoint sync;
+} blockWriter;
+
+THREAD_FUNC blockWriterThread(void* args)
+{
+    blockWriter* writer = args;
+
+    syncLock(&writer->sync);
+
+    while (1)
+    {
+        while (writer->queued == 0 && !writer->done)
+            syncWait(&writer->sync);
+
+        if (writer->queued == 0)
+            break;
+
+        // Everything queued so far goes out together
+        const char* buffers[STREAM_OUT_BUFFERS];
+        size_t lens[STREAM_OUT_BUFFERS];
+        int count = writer->queued;
+
+        for (int i = 0; i < count; i++)
+        {
+            int index = (writer->tail + i) % STREAM_OUT_BUFFERS;
+
+            buffers[i] = writer->blocks[index];
+            lens[i] = writer->lens[index];
+        }
+
+        syncUnlock(&writer->sync);
+
+        outputSubmit(writer->out, buffers, lens, count, &writer->pending[writer->tail]);
+
+        syncLock(&writer->sync);
+
+        writer->tail = (writer->tail + count) % STREAM_OUT_BUFFERS;
+        writer->queued -= count;
+
+        syncWakeAll(&writer->sync);
+    }
+
+    syncUnlock(&writer->sync);
+
+    THREAD_RETURN;
+}
+
+// Queues the current block for writing and waits until a free block is available
+
+void flushBlock(blockWriter* writer)
+{
+    if (writer->fill == 0)
+        return;
+
+    if (!writer->threaded)
+    {
+        const char* buffers[1] = { writer->blocks[writer->head] };
+
+        outputSubmit(writer->out, buffers, &writer->fill, 1, &writer->pending[writer->head]);
+
+        writer->head = (writer->head + 1) % STREAM_OUT_BUFFERS;
+        writer->fill = 0;
+
+        outputWait(writer->out, &writer->pending[writer->head]);
+
+        return;
+    }
+
+    syncLock(&writer->sync);
+
+    writer->lens[writer->head] = writer->fill;
+    writer->head = (writer->head + 1) % STREAM_OUT_BUFFERS;
+    writer->queued++;
+
+    syncWakeAll(&writer->sync);
+
+    while (writer->queued == STREAM_OUT_BUFFERS)
+        syncWait(&writer->sync);
+
+    syncUnlock(&writer->sync);
+
+    writer->fill = 0;
+}
+
+// Returns space for len bytes in the current block
+
+char* reserveOutput(blockWriter* writer, size_t len)
+{
+    if (writer->fill + len > writer->blockSize)
+        flushBlock(writer);
+
+    char* out = writer->blocks[writer->head] + writer->fill;
+
+    writer->fill += len;
+
+    return out;
+}
+
+// State of a streamed image, pixels are gathered into one row and converted row by row
+// While histogram is set rows are only counted, equalization streams the image twice
+
+typedef struct
+{
+    int width;
+    int height;
+    int maxValue;
+    int rowsDone;
+    int rowFill;
+    int rowsEmitted;
+    uint16_t* rowValues;
+    uint64_t* histogram;
+    int* errRows[2];
+    pgmQuantizer* quantizer;
+    pgmScaler* scaler;
+    blockWriter* writer;
+} pgmStream;
+
+void emitRow(pgmStream* stream, const uint16_t* values, int width)
+{
+    if (stream->histogram != NULL)
+    {
+        for (int col = 0; col < width; col++)
+            stream->histogram[values[col]]++;
+
+        return;
+    }
+
+    char* out = reserveOutput(stream->writer, width + 1);
+    int* errIn = stream->errRows[0];
+
+    quantizeRow(stream->quantizer, values, width, stream->rowsEmitted++, out, errIn, stream->errRows[1]);
+
+    // Error collected for the next row becomes its input
+    stream->errRows[0] = stream->errRows[1];
+    stream->errRows[1] = errIn;
+
+    memset(errIn, 0, (width + 2) * sizeof(int));
+}
+
+// Source rows go through the scaler if the image is scaled down
+
+void finishRow(pgmStream* stream)
+{
+    if (stream->scaler == NULL)
+        emitRow(stream, stream->rowValues, stream->width);
+    else if (scalerAddRow(stream->scaler, stream->rowsDone, stream->rowValues))
+        emitRow(stream, stream->scaler->outRow, stream->scaler->dstWidth);
+
+    stream->rowsDone++;
+    stream->rowFill = 0;
+}
+
+void pushValues(pgmStream* stream, const uint16_t* values, long count)
+{
+    for (long i = 0; i < count && stream->rowsDone < stream->height; i++)
+    {
+        stream->rowValues[stream->rowFill++] = values[i];
+
+        if (stream->rowFill == stream->width)
+            finishRow(stream);
+    }
+}
+
+// Converts text pixels of a window, only up to the last line break so no number or comment
+// is cut in half, the rest stays in the buffer for the next window
+// Returns number of bytes consumed
+
+long streamTextWindow(pgmStream* stream, char* buffer, long len, int lastWindow, uint16_t* values)
+{
+    long cut = len;
+
+    if (!lastWindow)
+    {
+        while (cut > 0 && buffer[cut - 1] != '\n')
+            cut--;
+
+        // Long lines are cut at whitespace instead, so at most one number is left behind
+        if (len - cut > STREAM_WINDOW / 2)
+        {
+            cut = len;
+
+            while (cut > 0 && !isspace((unsigned char)buffer[cut - 1]))
+                cut--;
+        }
+    }
+
+    pgmChunk chunk;
+
+    memset(&chunk, 0, sizeof(chunk));
+
+    chunk.data = buffer;
+    chunk.start = 0;
+    chunk.end = cut;
+    chunk.totalValues = cut / 2 + 1;
+    chunk.maxValue = stream->maxValue;
+    chunk.values = values;
+
+    long count = walkChunk(&chunk, 1);
+
+    pushValues(stream, values, count);
+
+    return cut;
+}
+
+// Converts binary pixels of a window, whole pixels only
+// Returns number of bytes consumed
+
+long streamBinaryWindow(pgmStream* stream, unsigned char* buffer, long len, int bytesPerPixel, uint16_t* values)
+{
+    long count = len / bytesPerPixel;
+
+    for (long i = 0; i < count; i++)
+    {
+        int value = bytesPerPixel == 1 ? buffer[i] : (buffer[2 * i] << 8) | buffer[2 * i + 1];
+
+        values[i] = (uint16_t)(value > stream->maxValue ? stream->maxValue : value);
+    }
+
+    pushValues(stream, values, count);
+
+    return count * bytesPerPixel;
+}
+
+// Reads the first window of the file
+// Returns number of bytes read
+
+long readFirstWindow(fileHandle in, char* buffer)
+{
+    long len = 0, got = 0;
+
+    while (len < STREAM_WINDOW && (got = readSome(in, buffer + len, STREAM_WINDOW - len)) > 0)
+        len += got;
+
+    buffer[len] = '\0';
+
+    return len;
+}
+
+// Feeds all pixels from offset pos of the first window on to the stream
+// Returns 1 if a number is longer than a window, it would not fit into the buffer
+
+int streamPixels(pgmStream* stream, fileHandle in, char* buffer, long len, long pos, int format, int bytesPerPixel, uint16_t* values)
+{
+    int lastWindow = 0;
+
+    while (stream->rowsDone < stream->height)
+    {
+        long consumed = format == 2
+            ? streamTextWindow(stream, buffer + pos, len - pos, lastWindow, values)
+            : streamBinaryWindow(stream, (unsigned char*)buffer + pos, len - pos, bytesPerPixel, values);
+
+        pos += consumed;
+
+        if (lastWindow)
+            break;
+
+        // Move leftover to the front and read the next window behind it
+        memmove(buffer, buffer + pos, len - pos);
+        len -= pos;
+        pos = 0;
+
+        if (len > STREAM_WINDOW)
+            return 1;
+
+        long got = readSome(in, buffer + len, STREAM_WINDOW);
+
+        if (got <= 0)
+            lastWindow = 1;
+        else
+            len += got;
+    }
+
+    return 0;
+}
+
+// Streams a PGM file into a text file, the header has to fit into the first window
+// columns and rows give the output size as described in getTargetSize
+// Returns 0 on success
+
+int streamASCIIArt(char* inPath, char* outPath, toneOptions* tone, int columns, int rows, int backend)
+{
+    fileHandle in = openInputFile(inPath);
+
+    if (!isOpenFile(in))
+    {
+        printf("Failed to open file!\n");
+
+        return 1;
+    }
+
+    // Input window is twice the read size, leftover of one window is moved to the front
+    char* buffer = (char*)malloc(2 * STREAM_WINDOW + 1);
+    uint16_t* values = (uint16_t*)malloc((STREAM_WINDOW + 1) * sizeof(uint16_t));
+    long len = 0;
+    int result = 1;
+
+    if (buffer == NULL || values == NULL)
+        goto cleanupInput;
+
+    len = readFirstWindow(in, buffer);
+
+    // File size is not needed, short files are found when the pixels run out
+    pgmHeader img;
+    int error = pgmParse(buffer, len, -1, &img);
+
+    if (error != PGM_OK)
+    {
+        printf("%s!\n", pgmErrorString(error));
+
+        goto cleanupInput;
+    }
+
+    long dataStart = img.dataStart;
+
+    outputFile out;
+
+    if (outputOpen(&out, outPath, backend))
+    {
+        printf("Failed to open file!\n");
+
+        goto cleanupInput;
+    }
+
+    blockWriter writer;
+    pgmStream stream;
+    pgmScaler scaler;
+    pgmQuantizer quantizer;
+    threadHandle writerThread;
+    int dstWidth, dstHeight;
+
+    memset(&writer, 0, sizeof(writer));
+    memset(&stream, 0, sizeof(stream));
+    memset(&quantizer, 0, sizeof(quantizer));
+
+    writer.blockSize = STREAM_OUT_BLOCK > (size_t)img.width + 1 ? STREAM_OUT_BLOCK : (size_t)img.width + 1;
+    writer.out = &out;
+    writer.threaded = out.backend != OUTPUT_URING;
+
+    syncInit(&writer.sync);
+
+    getTargetSize(img.width, img.height, columns, rows, &dstWidth, &dstHeight);
+
+    stream.width = img.width;
+    stream.height = img.height;
+    stream.maxValue = img.depth;
+    stream.rowValues = (uint16_t*)malloc(img.width * sizeof(uint16_t));
+    stream.errRows[0] = (int*)calloc(dstWidth + 2, sizeof(int));
+    stream.errRows[1] = (int*)calloc(dstWidth + 2, sizeof(int));
+    stream.quantizer = &quantizer;
+    stream.writer = &writer;
+
+    int allocated = stream.rowValues != NULL && stream.errRows[0] != NULL && stream.errRows[1] != NULL;
+
+    if (dstWidth != img.width || dstHeight != img.height)
+    {
+        if (scalerInit(&scaler, img.width, img.height, dstWidth, dstHeight, 0, dstHeight) == 0)
+            stream.scaler = &scaler;
+        else
+            allocated = 0;
+    }
+
+    for (int i = 0; i < STREAM_OUT_BUFFERS; i++)
+        allocated &= (writer.blocks[i] = (char*)malloc(writer.blockSize)) != NULL;
+
+#ifdef __linux__
+    if (!allocated || (writer.threaded && pthread_create(&writerThread, NULL, blockWriterThread, &writer)))
+#endif
+
+#ifdef _WIN32
+    if (!allocated || (writer.threaded && (writerThread = CreateThread(NULL, 0, blockWriterThread, &writer, 0, NULL)) == NULL))
+#endif
+    {
+        printf("Could not start streaming!\n");
+
+        goto cleanupOutput;
+    }
+
+    int bytesPerPixel = img.depth < 256 ? 1 : 2;
+    int toneFailed = 0, tooLong = 0;
+
+    // First pass only fills the histogram, then the file is read again from the start
+    if (tone->equalize)
+    {
+        stream.histogram = (uint64_t*)calloc(img.depth + 1, sizeof(uint64_t));
+
+        if (stream.histogram == NULL)
+            toneFailed = 1;
+        else
+        {
+            tooLong = streamPixels(&stream, in, buffer, len, dataStart, img.format, bytesPerPixel, values);
+
+            if (!tooLong && rewindFile(in))
+            {
+                printf("Equalization needs an input file that can be read twice!\n");
+
+                toneFailed = 1;
+            }
+
+            len = readFirstWindow(in, buffer);
+
+            stream.rowsDone = 0;
+            stream.rowFill = 0;
+
+            if (stream.scaler != NULL)
+                stream.scaler->accRow = -1;
+        }
+    }
+
+    if (!toneFailed)
+        toneFailed = quantizerInit(&quantizer, tone, img.depth, stream.histogram);
+
+    free(stream.histogram);
+    stream.histogram = NULL;
+
+    if (!toneFailed && !tooLong)
+        tooLong = streamPixels(&stream, in, buffer, len, dataStart, img.format, bytesPerPixel, values);
+
+    flushBlock(&writer);
+
+    if (writer.threaded)
+    {
+        syncLock(&writer.sync);
+        writer.done = 1;
+        syncWakeAll(&writer.sync);
+        syncUnlock(&writer.sync);
+
+#ifdef __linux__
+        pthread_join(writerThread, NULL);
+#endif
+
+#ifdef _WIN32
+        WaitForSingleObject(writerThread, INFINITE);
+        CloseHandle(writerThread);
+#endif
+    }
+
+    if (tooLong)
+        printf("Pixel value is longer than the read window!\n");
+    else if (toneFailed)
+        printf("Could not convert image!\n");
+    else if (stream.rowsDone < stream.height)
+        printf("File has less pixel data than width * height!\n");
+    else
+        result = 0;
+
+cleanupOutput:
+    if (stream.scaler != NULL)
+        scalerFree(stream.scaler);
+
+    // Queued writes finish before the blocks are freed
+    if (outputClose(&out) && result == 0)
+    {
+        printf("Writing output failed!\n");
+
+        result = 1;
+    }
+
+    for (int i = 0; i < STREAM_OUT_BUFFERS; i++)
+        free(writer.blocks[i]);
+
+    free(stream.rowValues);
+    free(stream.errRows[0]);
+    free(stream.errRows[1]);
+    quantizerFree(&quantizer);
+    syncDestroy(&writer.sync);
+
+cleanupInput:
+    free(buffer);
+    free(values);
+    closeFile(in);
+
+    return result;
+}
+
+// Batch conversion, files are handed out to a pool of workers one at a time
+// Every worker converts a whole file on its own and keeps its input and output buffers for the
+// next file, so small files cost a read and a write instead of mappings and new allocations
+
+typedef struct
+{
+    char** inputs;
+    char** outPaths;
+    int inputCnt;
+    int nextInput;
+    int failedCnt;
+    char* outDir;
+    toneOptions* tone;
+    int columns;
+    int rows;
+    int backend;
+    int streaming;
+    syncPoint sync;
+} batchJob;
+
+typedef struct
+{
+    batchJob* job;
+    char* inBuffer;
+    size_t inCapacity;
+    char* outBuffer;
+    size_t outCapacity;
+} batchWorker;
+
+// Makes sure a worker buffer can hold len bytes, contents are kept
+// Returns 0 on success
+
+int reserveBuffer(char** buffer, size_t* capacity, size_t len)
+{
+    if (len <= *capacity)
+        return 0;
+
+    size_t newCapacity = *capacity ? *capacity : 1 << 16;
+
+    while (newCapacity < len)
+        newCapacity *= 2;
+
+    char* newBuffer = (char*)realloc(*buffer, newCapacity);
+
+    if (newBuffer == NULL)
+        return 1;
+
+    *buffer = newBuffer;
+    *capacity = newCapacity;
+
+    return 0;
+}
+
+// Output file is the input file name with .txt instead of its extension, placed in outDir
+
+char* getOutputPath(char* outDir, char* input)
+{
+    char* name = input;
+
+    for (char* c = input; *c; c++)
+    {
+        if (*c == '/' || *c == '\\')
+            name = c + 1;
+    }
+
+    size_t nameLen = strlen(name);
+    char* dot = strrchr(name, '.');
+
+    if (dot != NULL && dot != name)
+        nameLen = dot - name;
+
+    size_t dirLen = strlen(outDir);
+    char* path = (char*)malloc(dirLen + nameLen + 6);
+
+    if (path == NULL)
+        return NULL;
+
+#ifdef __linux__
+    char separator = '/';
+#endif
+
+#ifdef _WIN32
+    char separator = '\\';
+#endif
+
+    memcpy(path, outDir, dirLen);
+
+    if (dirLen > 0 && outDir[dirLen - 1] != separator)
+        path[dirLen++] = separator;
+
+    memcpy(path + dirLen, name, nameLen);
+    strcpy(path + dirLen + nameLen, ".txt");
+
+    return path;
+}
+
+// Compares two output paths, Windows file names ignore case
+// Returns 0 if both name the same file
+
+int comparePaths(char* pathA, char* pathB)
+{
+#ifdef __linux__
+    return strcmp(pathA, pathB);
+#endif
+
+#ifdef _WIN32
+    return _stricmp(pathA, pathB);
+#endif
+}
+
+// Orders pointers into the output path list by path and then by position, so the earliest input
+// of a name sorts first
+
+int compareOutputPaths(const void* a, const void* b)
+{
+    char** pathA = *(char** const*)a;
+    char** pathB = *(char** const*)b;
+    int order = comparePaths(*pathA, *pathB);
+
+    if (order != 0)
+        return order;
+
+    return pathA < pathB ? -1 : pathA > pathB;
+}
+
+// Builds the output path of every input, an input whose output is already taken by an earlier one
+// is reported and gets no path, so no two workers write the same file
+// Returns number of such inputs or -1 on failure
+
+int getOutputPaths(char** inputs, int inputCnt, char* outDir, char** outPaths)
+{
+    char*** sorted = (char***)malloc((inputCnt > 0 ? inputCnt : 1) * sizeof(char**));
+    int duplicateCnt = 0;
+
+    if (sorted == NULL)
+        return -1;
+
+    for (int i = 0; i < inputCnt; i++)
+    {
+        outPaths[i] = getOutputPath(outDir, inputs[i]);
+        sorted[i] = outPaths + i;
+
+        if (outPaths[i] == NULL)
+        {
+            for (int j = 0; j < i; j++)
+                free(outPaths[j]);
+
+            free(sorted);
+
+            return -1;
+        }
+    }
+
+    qsort(sorted, inputCnt, sizeof(char**), compareOutputPaths);
+
+    for (int i = 1, first = 0; i < inputCnt; i++)
+    {
+        if (comparePaths(*sorted[first], *sorted[i]) != 0)
+        {
+            first = i;
+
+            continue;
+        }
+
+        printf("%s: Output %s is already written for %s!\n", inputs[sorted[i] - outPaths], *sorted[first], inputs[sorted[first] - outPaths]);
+
+        free(*sorted[i]);
+        *sorted[i] = NULL;
+        duplicateCnt++;
+    }
+
+    free(sorted);
+
+    return duplicateCnt;
+}
+
+// Reads a whole file into the worker input buffer, a 0 is placed after the data
+// Returns file length or -1 on failure
+
+long readWholeFile(batchWorker* worker, char* path)
+{
+    fileHandle fd = openInputFile(path);
+    long len = 0, got = 0;
+
+    if (!isOpenFile(fd))
+        return -1;
+
+    while (1)
+    {
+        if (reserveBuffer(&worker->inBuffer, &worker->inCapacity, len + STREAM_WINDOW + 1))
+        {
+            got = -1;
+
+            break;
+        }
+
+        got = readSome(fd, worker->inBuffer + len, STREAM_WINDOW);
+
+        if (got <= 0)
+            break;
+
+        len += got;
+    }
+
+    closeFile(fd);
+
+    if (got < 0)
+        return -1;
+
+    worker->inBuffer[len] = '\0';
+
+    return len;
+}
+
+// Converts one file of the batch
+// Returns 0 on success, errors are printed with the file name
+
+int convertBatchFile(batchWorker* worker, char* input, char* outPath)
+{
+    batchJob* job = worker->job;
+    pgmImage img;
+    int dstWidth, dstHeight;
+
+    // Streamed files go straight from input to output, the worker buffers are not used
+    if (job->streaming)
+    {
+        int failed = streamASCIIArt(input, outPath, job->tone, job->columns, job->rows, job->backend);
+
+        if (failed)
+            printf("%s: Could not convert image!\n", input);
+
+        return failed;
+    }
+
+    memset(&img, 0, sizeof(img));
+
+    long len = readWholeFile(worker, input);
+
+    if (len < 0)
+    {
+        printf("%s: Failed to open file!\n", input);
+
+        return 1;
+    }
+
+    pgmHeader header;
+    int error = pgmParse(worker->inBuffer, len, len, &header);
+
+    if (error == PGM_OK && (long long)header.width * header.height > PGM_MAX_PIXELS)
+        error = PGM_ERR_PIXELS;
+
+    if (error != PGM_OK)
+    {
+        printf("%s: %s!\n", input, pgmErrorString(error));
+
+        return 1;
+    }
+
+    img.data = worker->inBuffer;
+    img.dataLen = len;
+    img.dataStart = header.dataStart;
+    img.format = header.format;
+    img.width = header.width;
+    img.height = header.height;
+    img.depth = header.depth;
+
+    getTargetSize(img.width, img.height, job->columns, job->rows, &dstWidth, &dstHeight);
+
+    size_t outLen = (size_t)(dstWidth + 1) * dstHeight;
+
+    if (reserveBuffer(&worker->outBuffer, &worker->outCapacity, outLen) || createASCIIArt(img, job->tone, 1, dstWidth, dstHeight, worker->outBuffer) == NULL)
+    {
+        printf("%s: Could not convert image!\n", input);
+
+        return 1;
+    }
+
+    const char* buffers[1] = { worker->outBuffer };
+    outputFile out;
+    int pending = 0;
+    int failed = outputOpen(&out, outPath, job->backend);
+
+    if (!failed)
+    {
+        outputSubmit(&out, buffers, &outLen, 1, &pending);
+        failed = outputClose(&out);
+    }
+
+    if (failed)
+        printf("%s: Writing output failed!\n", input);
+
+    return failed;
+}
+
+THREAD_FUNC batchWorkerThread(void* args)
+{
+    batchWorker* worker = args;
+    batchJob* job = worker->job;
+
+    while (1)
+    {
+        syncLock(&job->sync);
+
+        int index = job->nextInput++;
+
+        syncUnlock(&job->sync);
+
+        if (index >= job->inputCnt)
+            break;
+
+        // Inputs without output path were already counted as failed
+        if (job->outPaths[index] == NULL)
+            continue;
+
+        if (convertBatchFile(worker, job->inputs[index], job->outPaths[index]))
+        {
+            syncLock(&job->sync);
+            job->failedCnt++;
+            syncUnlock(&job->sync);
+        }
+    }
+
+    free(worker->inBuffer);
+    free(worker->outBuffer);
+
+    THREAD_RETURN;
+}
+
+// Adds every non empty line of a manifest file to the input list
+// Returns new number of inputs or -1 on failure, the manifest buffer is kept as it holds the names
+
+int readManifest(char* path, char*** inputs, int inputCnt, char** manifestData)
+{
+    batchWorker reader;
+
+    memset(&reader, 0, sizeof(reader));
+
+    long len = readWholeFile(&reader, path);
+
+    if (len < 0)
+    {
+        printf("%s: Failed to open file!\n", path);
+
+        return -1;
+    }
+
+    int lineCnt = 1;
+
+    for (long i = 0; i < len; i++)
+        lineCnt += reader.inBuffer[i] == '\n';
+
+    char** newInputs = (char**)realloc(*inputs, (inputCnt + lineCnt) * sizeof(char*));
+
+    if (newInputs == NULL)
+    {
+        free(reader.inBuffer);
+
+        return -1;
+    }
+
+    char* line = reader.inBuffer;
+
+    for (long i = 0; i <= len; i++)
+    {
+        if (reader.inBuffer[i] != '\n' && reader.inBuffer[i] != '\0')
+            continue;
+
+        reader.inBuffer[i] = '\0';
+
+        if (reader.inBuffer + i > line && reader.inBuffer[i - 1] == '\r')
+            reader.inBuffer[i - 1] = '\0';
+
+        if (*line)
+            newInputs[inputCnt++] = line;
+
+        line = reader.inBuffer + i + 1;
+    }
+
+    *inputs = newInputs;
+    *manifestData = reader.inBuffer;
+
+    return inputCnt;
+}
+
+// Converts all inputs into outDir with threadCnt workers, with streaming every file is streamed
+// Returns 0 if every file was converted
+
+int convertBatch(char** inputs, int inputCnt, char* outDir, toneOptions* tone, int columns, int rows, int backend, int streaming, int threadCnt)
+{
+    batchWorker workers[MAX_THREADS];
+    batchJob job;
+    char** outPaths = (char**)malloc((inputCnt > 0 ? inputCnt : 1) * sizeof(char*));
+    int duplicateCnt = outPaths == NULL ? -1 : getOutputPaths(inputs, inputCnt, outDir, outPaths);
+
+    if (duplicateCnt < 0)
+    {
+        free(outPaths);
+
+        return 1;
+    }
+
+    job.inputs = inputs;
+    job.outPaths = outPaths;
+    job.inputCnt = inputCnt;
+    job.nextInput = 0;
+    job.failedCnt = duplicateCnt;
+    job.outDir = outDir;
+    job.tone = tone;
+    job.columns = columns;
+    job.rows = rows;
+    job.backend = backend;
+    job.streaming = streaming;
+
+    syncInit(&job.sync);
+
+    if (threadCnt > MAX_THREADS)
+        threadCnt = MAX_THREADS;
+
+    if (threadCnt > inputCnt)
+        threadCnt = inputCnt;
+
+    if (threadCnt < 1)
+        threadCnt = 1;
+
+    memset(workers, 0, sizeof(workers));
+
+    for (int i = 0; i < threadCnt; i++)
+        workers[i].job = &job;
+
+    runThreads(batchWorkerThread, workers, sizeof(batchWorker), threadCnt);
+
+    syncDestroy(&job.sync);
+
+    for (int i = 0; i < inputCnt; i++)
+        free(outPaths[i]);
+
+    free(outPaths);
+
+    printf("Converted %d of %d files\n", inputCnt - job.failedCnt, inputCnt);
+
+    return job.failedCnt > 0;
+}
+
+// Usage: multiplatform_pgm [options] [-s] input.pgm output.txt pallette
+//        multiplatform_pgm [options] [-s] -o outdir [-m manifest] input.pgm ... pallette
+// Options: [-t threads] [-w backend] [-c columns] [-r rows] [-g gamma] [-e] [-d ordered|floyd]
+// -s streams the image instead of mapping it, for images that do not fit into memory
+// -c and -r scale the image down, with only one of them the other keeps the aspect ratio
+// -o converts a batch of files into outdir, -m reads more inputs from a file with one path per line
+// -w picks how output is written: write (default), pwritev or uring
+// -g applies a gamma, above 1 brightens, -e equalizes the histogram
+// -d dithers with ordered (Bayer) or floyd (Floyd-Steinberg), the pallette can have any length
+// Options have to come before the file names, "--" ends them
+
+int main(int argc, char* argv[])
+{
+    int threadCnt = getCpuCount();
+    int streaming = 0;
+    int columns = 0;
+    int rows = 0;
+    char* outDir = NULL;
+    char* manifest = NULL;
+    int backend = OUTPUT_WRITE;
+    toneOptions tone = { NULL, 1.0, 0, DITHER_NONE };
+    int argIndex = 1;
+
+    while (argIndex < argc && argv[argIndex][0] == '-')
+    {
+        if (strcmp(argv[argIndex], "--") == 0)
+        {
+            argIndex++;
+
+            break;
+        }
+
+        if (strcmp(argv[argIndex], "-t") == 0 && argIndex + 1 < argc)
+        {
+            threadCnt = atoi(argv[argIndex + 1]);
+            argIndex += 2;
+        }
+        else if (strcmp(argv[argIndex], "-c") == 0 && argIndex + 1 < argc)
+        {
+            columns = atoi(argv[argIndex + 1]);
+            argIndex += 2;
+        }
+        else if (strcmp(argv[argIndex], "-r") == 0 && argIndex + 1 < argc)
+        {
+            rows = atoi(argv[argIndex + 1]);
+            argIndex += 2;
+        }
+        else if (strcmp(argv[argIndex], "-o") == 0 && argIndex + 1 < argc)
+        {
+            outDir = argv[argIndex + 1];
+            argIndex += 2;
+        }
+        else if (strcmp(argv[argIndex], "-m") == 0 && argIndex + 1 < argc)
+        {
+            manifest = argv[argIndex + 1];
+            argIndex += 2;
+        }
+        else if (strcmp(argv[argIndex], "-w") == 0 && argIndex + 1 < argc)
+        {
+            char* name = argv[argIndex + 1];
+
+            if (strcmp(name, "write") == 0)
+                backend = OUTPUT_WRITE;
+            else if (strcmp(name, "pwritev") == 0)
+                backend = OUTPUT_PWRITEV;
+            else if (strcmp(name, "uring") == 0)
+                backend = OUTPUT_URING;
+            else
+            {
+                printf("Unknown output backend %s\n", name);
+
+                return 1;
+            }
+
+            argIndex += 2;
+        }
+        else if (strcmp(argv[argIndex], "-g") == 0 && argIndex + 1 < argc)
+        {
+            tone.gamma = atof(argv[argIndex + 1]);
+            argIndex += 2;
+
+            if (tone.gamma <= 0)
+            {
+                printf("Gamma has to be above 0!\n");
+
+                return 1;
+            }
+        }
+        else if (strcmp(argv[argIndex], "-e") == 0)
+        {
+            tone.equalize = 1;
+            argIndex++;
+        }
+        else if (strcmp(argv[argIndex], "-d") == 0 && argIndex + 1 < argc)
+        {
+            char* name = argv[argIndex + 1];
+
+            if (strcmp(name, "ordered") == 0)
+                tone.dither = DITHER_ORDERED;
+            else if (strcmp(name, "floyd") == 0)
+                tone.dither = DITHER_FLOYD;
+            else
+            {
+                printf("Unknown dithering %s\n", name);
+
+                return 1;
+            }
+
+            argIndex += 2;
+        }
+        else if (strcmp(argv[argIndex], "-s") == 0)
+        {
+            streaming = 1;
+            argIndex++;
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[argIndex]);
+
+            return 1;
+        }
+    }
+
+    // Like a single file the pallette comes last, after the inputs
+    if (outDir != NULL)
+    {
+        if (argIndex >= argc || argv[argc - 1][0] == '\0')
+        {
+            printf("Missing pallette!\n");
+
+            return 1;
+        }
+
+        tone.pallette = argv[argc - 1];
+
+        char** inputs = NULL;
+        char* manifestData = NULL;
+        int inputCnt = argc - argIndex - 1;
+
+        if (inputCnt > 0)
+        {
+            inputs = (char**)malloc(inputCnt * sizeof(char*));
+
+            if (inputs == NULL)
+                return 1;
+
+            memcpy(inputs, argv + argIndex, inputCnt * sizeof(char*));
+        }
+
+        if (manifest != NULL && (inputCnt = readManifest(manifest, &inputs, inputCnt, &manifestData)) < 0)
+        {
+            free(inputs);
+
+            return 1;
+        }
+
+        int failed = convertBatch(inputs, inputCnt, outDir, &tone, columns, rows, backend, streaming, threadCnt);
+
+        free(inputs);
+        free(manifestData);
+
+        return failed;
+    }
+
+    if (argc - argIndex != 3)
+    {
+        printf("Too many or too few arguments!\n");
+
+        return 1;
+    }
+
+    char* pgmFile = argv[argIndex];
+    char* txtFile = argv[argIndex + 1];
+    char* buffer = NULL;
+
+    tone.pallette = argv[argIndex + 2];
+
+    if (tone.pallette[0] == '\0')
+    {
+        printf("Missing pallette!\n");
+
+        return 1;
+    }
+
+    if (streaming)
+        return streamASCIIArt(pgmFile, txtFile, &tone, columns, rows, backend);
+
+    pgmImage img;
+
+    if (getPgmFile(pgmFile, &img))
+        return 1;
+
+    int dstWidth, dstHeight;
+
+    getTargetSize(img.width, img.height, columns, rows, &dstWidth, &dstHeight);
+
+    size_t ASCIIimgLen = (size_t)(dstWidth + 1) * dstHeight;
+
+    buffer = createASCIIArt(img, &tone, threadCnt, dstWidth, dstHeight, NULL);
+
+    closePgmFile(img);
+
+    if (buffer == NULL)
+    {
+        printf("Could not convert image!\n");
+
+        return 1;
+    }
+
+    int failed = writeToTextFile(txtFile, buffer, ASCIIimgLen, backend);
 
     free(buffer);
 
-    return 0;
-}
\ No newline at end of file
+    return failed;
+}
@@ -1,60 +1,2484 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <spawn.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <zlib.h>
 
-int main(int argc, char ** argv)
+// zstd is only built in with -DHAVE_ZSTD, link with -lzstd then
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define FORMAT_GZIP 0
+#define FORMAT_ZSTD 1
+
+extern char ** environ;
+
+// Adaptive job count, checked at most once per interval, pressure is the percentage of the last
+// 10 seconds in which some task waited for cpu or io
+#define LOAD_INTERVAL_MS 1000
+#define PRESSURE_HIGH 20.0
+#define PRESSURE_LOW 5.0
+
+// Outputs are written under this suffix and renamed when complete, so a killed run never leaves
+// a truncated file under the real name
+#define TEMP_SUFFIX ".parzip-tmp"
+
+// Only the start of upcoming files is read ahead, sequential readahead takes over from there and
+// large files do not push everything else out of the page cache
+#define PREFETCH_BYTES (8 << 20)
+
+// Progress lines are printed at most once per interval
+#define PROGRESS_INTERVAL_MS 1000
+
+// Files below the batch threshold are packed into tar streams of about this size
+#define BATCH_TARGET (32 << 20)
+#define TAR_BLOCK 512
+#define TAR_COPY_BUFFER (64 << 10)
+
+// io priority classes of ioprio_set
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+// Default size of one independently compressed block
+#define DEFAULT_BLOCK_SIZE (1 << 20)
+
+// Seekable output ends with an index of compressed block sizes, the text is kept in the comment
+// of an empty gzip member or in a zstd skippable frame so normal decompressors ignore it
+#define INDEX_MAGIC "parzip-index"
+#define INDEX_LEN_DIGITS 16
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A5E
+
+// Empty deflate block, crc and size of an empty gzip member that carries the index
+#define GZIP_INDEX_TAIL 11
+
+// Small files packed into one tar stream, a thread writes the stream into fd
+
+struct batch
 {
-    // Check if minimum number of arguments was met, if not informs user and returns error code
-    if(argc < 3)
+    struct job * files;
+    int fileCnt;
+    int fd;
+    int failed;
+    int badFiles;
+    int hashFiles;
+    pthread_t thread;
+};
+
+// One file or batch to compress and the child process working on it
+
+struct job
+{
+    char * path;
+    char * outPath;
+    struct batch * batch;
+    off_t size;
+    long long mtimeNs;
+    pid_t pid;
+    int status;
+    int started;
+    int error;
+    long long startMs;
+    long long wallMs;
+    struct rusage usage;
+    unsigned long crc;
+    int hashed;
+};
+
+// Counters for progress lines and the per file report
+
+struct progress
+{
+    int show;
+    FILE * report;
+    int total;
+    int done;
+    long long bytesTotal;
+    long long bytesIn;
+    long long bytesOut;
+    long long liveIn;
+    long long liveOut;
+    long long startMs;
+    long long lastPrintMs;
+};
+
+// Compressor command line split into words, the file path is added as last argument unless
+// suffix is set, then the file is given on standard input and output goes to path with suffix
+
+struct command
+{
+    char ** argv;
+    int argc;
+    char * suffix;
+};
+
+// Largest files go first, they decide when the whole run ends
+
+int compareJobs(const void * a, const void * b)
+{
+    const struct job * first = a;
+    const struct job * second = b;
+
+    if (first->size != second->size)
+        return first->size < second->size ? 1 : -1;
+
+    return 0;
+}
+
+// Reads until len bytes are read or the file ends
+// Returns number of bytes read or -1 on failure
+
+ssize_t readFull(int fd, unsigned char * buffer, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len)
     {
-        printf("Not enough arguments!\n");
+        ssize_t got = read(fd, buffer + done, len - done);
+
+        if (got < 0)
+            return -1;
+
+        if (got == 0)
+            break;
+
+        done += got;
+    }
+
+    return done;
+}
+
+// Writes all of len bytes, returns 1 on failure
+
+int writeFull(int fd, const unsigned char * data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+
+        if (written <= 0)
+            return 1;
+
+        data += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+// Asks the kernel to start reading the beginning of a file into the page cache, so it is there by
+// the time a compressor or batch gets to it
+
+void prefetchFile(const char * path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return;
+
+    posix_fadvise(fd, 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+
+    close(fd);
+}
+
+// Fills a ustar header block, numbers are octal text and the checksum covers the whole block
+
+void tarHeader(char * header, const char * name, char type, off_t size, mode_t mode, time_t mtime)
+{
+    size_t nameLen = strlen(name);
+    unsigned int sum = 0;
+
+    memset(header, 0, TAR_BLOCK);
+
+    // Names over 100 characters are split at a slash into prefix and name, callers make sure it fits
+    if (nameLen > 100)
+    {
+        const char * split = strchr(name + nameLen - 101, '/');
+
+        memcpy(header + 345, name, split - name);
+        name = split + 1;
+        nameLen = strlen(name);
+    }
+
+    memcpy(header, name, nameLen);
+    snprintf(header + 100, 8, "%07o", (unsigned int)(mode & 07777));
+    snprintf(header + 108, 8, "%07o", 0);
+    snprintf(header + 116, 8, "%07o", 0);
+    snprintf(header + 124, 12, "%011llo", (unsigned long long)size);
+    snprintf(header + 136, 12, "%011llo", (unsigned long long)mtime);
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    memset(header + 148, ' ', 8);
+
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (unsigned char)header[i];
+
+    snprintf(header + 148, 8, "%06o", sum);
+    header[155] = ' ';
+}
+
+// Checks if a name can be split into a ustar prefix of 155 and name of 100 characters
+
+int fitsUstar(const char * name)
+{
+    size_t nameLen = strlen(name);
+
+    if (nameLen <= 100)
+        return 1;
+
+    const char * split = strchr(name + nameLen - 101, '/');
+
+    return split != NULL && split - name <= 155 && split[1] != '\0';
+}
+
+// Adds one file to a tar stream, longer names get a GNU long name entry first
+// With crc set the data is copied instead of spliced so its crc32 comes for free
+// Returns 0 on success, 1 if the file could not be read and 2 if the stream could not be written
+
+int writeTarEntry(int fd, char * path, char * buffer, unsigned long * crc)
+{
+    struct stat info;
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (in < 0 || fstat(in, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        printf("%s: could not add to batch\n", path);
+
+        if (in >= 0)
+            close(in);
 
         return 1;
     }
 
-    char zipProgram[40] = "/usr/bin/";
-    int argumentNum = 2, status = 0;
-    pid_t childPid, waitPid;
+    // Like tar, stored names never start at the root
+    char * name = path;
 
-    strcat(zipProgram, argv[1]); 
+    while (*name == '/')
+        name++;
 
-    for (int i = 0; i < argc - 2; i++)
+    if (!fitsUstar(name))
     {
-        childPid = fork();
+        size_t nameLen = strlen(name) + 1;
+        size_t padded = (nameLen + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        char * longName = calloc(padded, 1);
+
+        tarHeader(buffer, "././@LongLink", 'L', nameLen, 0644, 0);
 
-        // Check if child process creation failed
-        if (childPid < 0)
+        if (longName == NULL || writeFull(fd, (unsigned char *)buffer, TAR_BLOCK)
+            || writeFull(fd, (unsigned char *)memcpy(longName, name, nameLen), padded))
         {
-            printf("Fork creation failed!");
+            free(longName);
+            close(in);
 
-            exit(-1);
+            return 2;
         }
-        // If child process was succesfully created, execute file compression with desired program
-        else if(childPid == 0)
+
+        free(longName);
+
+        // Header keeps the last 100 characters, readers take the long name before it
+        name += nameLen - 1 - 100;
+    }
+
+    tarHeader(buffer, name, '0', info.st_size, info.st_mode, info.st_mtime);
+
+    if (writeFull(fd, (unsigned char *)buffer, TAR_BLOCK))
+    {
+        close(in);
+
+        return 2;
+    }
+
+    // Data goes from the page cache into the pipe with splice without being copied through parzip,
+    // files that do not support it fall back to the copy below which continues at the file position
+    off_t left = info.st_size;
+    int result = 0;
+
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (crc != NULL)
+        *crc = crc32(0, NULL, 0);
+
+    while (crc == NULL && left > 0)
+    {
+        ssize_t moved = splice(in, NULL, fd, NULL, left, SPLICE_F_MORE);
+
+        if (moved <= 0)
         {
-            int check = execl(zipProgram, zipProgram , argv[argumentNum], NULL);
-            
-            // Check if compression ended succesfully if not inform user 
-            if(check == -1)
+            // The compressor is gone
+            if (moved < 0 && errno == EPIPE)
             {
-                printf("Could not exececute %s, program might not exist.\n", argv[1]);
+                close(in);
 
-                exit(-1);
+                return 2;
             }
+
+            break;
+        }
+
+        left -= moved;
+    }
+
+    // The header promised st_size bytes, a file that shrinks meanwhile is padded with zeros
+    while (left > 0)
+    {
+        size_t want = left < TAR_COPY_BUFFER ? left : TAR_COPY_BUFFER;
+        ssize_t got = result ? 0 : readFull(in, (unsigned char *)buffer, want);
+
+        if (crc != NULL && got > 0)
+            *crc = crc32(*crc, (unsigned char *)buffer, got);
+
+        if (got < (ssize_t)want)
+        {
+            memset(buffer + (got > 0 ? got : 0), 0, want - (got > 0 ? got : 0));
+
+            if (!result)
+                printf("%s: changed while adding to batch\n", path);
+
+            result = 1;
+        }
+
+        if (writeFull(fd, (unsigned char *)buffer, want))
+        {
+            close(in);
+
+            return 2;
+        }
+
+        left -= want;
+    }
+
+    close(in);
+
+    size_t padding = (TAR_BLOCK - info.st_size % TAR_BLOCK) % TAR_BLOCK;
+
+    memset(buffer, 0, TAR_BLOCK);
+
+    return writeFull(fd, (unsigned char *)buffer, padding) ? 2 : result;
+}
+
+// Writes all files of a batch as one tar stream into the batch fd and closes it
+// Files that cannot be read are left out and get an error, the batch only fails when the stream breaks
+
+void * batchThread(void * args)
+{
+    struct batch * batch = args;
+    char * buffer = malloc(TAR_COPY_BUFFER);
+    int result = buffer == NULL ? 2 : 0;
+    int prefetched = 0;
+    off_t ahead = 0;
+
+    for (int i = 0; result < 2 && i < batch->fileCnt; i++)
+    {
+        // Files are small, so reading one ahead would barely start before it is needed, instead keep
+        // up to PREFETCH_BYTES of upcoming files in flight
+        for (; prefetched < batch->fileCnt && (prefetched <= i || ahead < PREFETCH_BYTES); prefetched++)
+        {
+            if (prefetched > i)
+                prefetchFile(batch->files[prefetched].path);
+
+            ahead += batch->files[prefetched].size;
         }
 
-        // Parent process iterates over arguments to compress all files
+        ahead -= batch->files[i].size;
+
+        struct job * file = &batch->files[i];
+        int fileResult = writeTarEntry(batch->fd, file->path, buffer, batch->hashFiles ? &file->crc : NULL);
+
+        file->hashed = batch->hashFiles && fileResult == 0;
+        file->error = fileResult != 0 ? EIO : 0;
+        batch->badFiles += fileResult == 1;
+        result |= fileResult;
+    }
+
+    // Two empty blocks end the archive
+    if (result < 2)
+    {
+        memset(buffer, 0, TAR_BLOCK);
+
+        if (writeFull(batch->fd, (unsigned char *)buffer, TAR_BLOCK) || writeFull(batch->fd, (unsigned char *)buffer, TAR_BLOCK))
+            result = 2;
+    }
+
+    close(batch->fd);
+    free(buffer);
+
+    batch->failed = result >= 2;
+
+    return NULL;
+}
+
+// Starts writing the tar stream of a batch into the write end of a pipe
+// Returns the read end or -1 on failure
+
+int startBatch(struct batch * batch)
+{
+    int pipeFds[2];
+
+    if (pipe2(pipeFds, O_CLOEXEC) != 0)
+        return -1;
+
+    batch->fd = pipeFds[1];
+
+    if (pthread_create(&batch->thread, NULL, batchThread, batch))
+    {
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+
+        return -1;
+    }
+
+    return pipeFds[0];
+}
+
+// Moves all files below threshold out of jobs into batch jobs named batch-N.tar with suffix,
+// a batch is closed when it reaches target bytes, jobs need their sizes
+// With keepExisting numbers of batches that are already on disk are skipped and the batch
+// threads hash the files for the manifest
+// Returns the new number of jobs or -1 when out of memory
+
+int groupSmallFiles(struct job * jobs, int jobCnt, off_t threshold, off_t target, const char * suffix, int keepExisting)
+{
+    int smallCnt = 0, kept = 0, batchNumber = 0, failed = 0;
+
+    for (int i = 0; i < jobCnt; i++)
+        smallCnt += jobs[i].size < threshold;
+
+    if (smallCnt == 0)
+        return jobCnt;
+
+    struct job * small = malloc(smallCnt * sizeof(struct job));
+
+    if (small == NULL)
+        return -1;
+
+    smallCnt = 0;
+
+    for (int i = 0; i < jobCnt; i++)
+    {
+        if (jobs[i].size < threshold)
+            small[smallCnt++] = jobs[i];
         else
-            argumentNum++;
-        
+            jobs[kept++] = jobs[i];
+    }
+
+    // Batches take the freed job slots, there are never more batches than small files
+    for (int first = 0; !failed && first < smallCnt;)
+    {
+        int last = first;
+        off_t size = 0;
+
+        while (last < smallCnt && (last == first || size + small[last].size <= target))
+            size += small[last++].size;
+
+        struct job * job = &jobs[kept++];
+        size_t len = strlen(suffix) + 32;
+
+        memset(job, 0, sizeof(struct job));
+        job->batch = calloc(1, sizeof(struct batch));
+        job->outPath = malloc(len);
+
+        if (job->batch == NULL || job->outPath == NULL
+            || (job->batch->files = malloc((last - first) * sizeof(struct job))) == NULL)
+        {
+            failed = 1;
+
+            break;
+        }
+
+        do
+            snprintf(job->outPath, len, "batch-%d.tar%s", ++batchNumber, suffix);
+        while (keepExisting && access(job->outPath, F_OK) == 0);
+
+        memcpy(job->batch->files, small + first, (last - first) * sizeof(struct job));
+
+        job->batch->hashFiles = keepExisting;
+
+        job->path = job->outPath;
+        job->size = size;
+        job->batch->fileCnt = last - first;
+
+        first = last;
+    }
+
+    free(small);
+
+    return failed ? -1 : kept;
+}
+
+// Frees what groupSmallFiles and startJob allocated for jobs
+
+void freeJobs(struct job * jobs, int jobCnt)
+{
+    for (int i = 0; i < jobCnt; i++)
+    {
+        if (jobs[i].batch != NULL)
+            free(jobs[i].batch->files);
+
+        free(jobs[i].batch);
+        free(jobs[i].outPath);
+    }
+
+    free(jobs);
+}
+
+void getTempPath(char * tempPath, size_t len, const char * path)
+{
+    snprintf(tempPath, len, "%s%s", path, TEMP_SUFFIX);
+}
+
+// Gives a finished output its real name or removes it if the job failed
+// Returns 1 if the job failed or the rename did not work
+
+int finishOutput(const char * path, int failed)
+{
+    char tempPath[PATH_MAX];
+
+    getTempPath(tempPath, sizeof(tempPath), path);
+
+    if (failed)
+    {
+        unlink(tempPath);
+
+        return 1;
+    }
+
+    if (rename(tempPath, path) != 0)
+    {
+        printf("%s: could not rename %s\n", path, tempPath);
+
+        unlink(tempPath);
+
+        return 1;
     }
 
-    //Parent waits to prevent zombie processes
-    while ((waitPid = wait(&status)) > 0)
-    
+    return 0;
+}
+
+// Splits a command line like "zstd -19 -T1" on spaces, the program is looked up in PATH
+// Returns 1 if there is no program or no memory
+
+int parseCommand(char * line, struct command * command)
+{
+    command->argc = 0;
+    command->argv = malloc((strlen(line) / 2 + 3) * sizeof(char *));
+
+    if (command->argv == NULL)
+        return 1;
+
+    for (char * word = strtok(line, " \t"); word != NULL; word = strtok(NULL, " \t"))
+        command->argv[command->argc++] = word;
+
+    // One slot stays free for the file path and one for the terminating NULL
+    command->argv[command->argc] = NULL;
+    command->argv[command->argc + 1] = NULL;
+
+    return command->argc == 0;
+}
+
+// Checks if outPath already is the input of a job or one of its batch files under another name,
+// renaming the finished output there would replace the input
+
+int overwritesInput(struct job * job, const char * outPath)
+{
+    struct stat out, in;
+
+    if (stat(outPath, &out) != 0)
+        return 0;
+
+    if (job->batch == NULL)
+        return stat(job->path, &in) == 0 && in.st_dev == out.st_dev && in.st_ino == out.st_ino;
 
+    for (int i = 0; i < job->batch->fileCnt; i++)
+    {
+        if (stat(job->batch->files[i].path, &in) == 0 && in.st_dev == out.st_dev && in.st_ino == out.st_ino)
+            return 1;
+    }
 
     return 0;
-}
\ No newline at end of file
+}
+
+// Spawns a child that runs the compression command on one file
+// posix_spawn does not copy our page tables like fork does, glibc starts the child with
+// clone(CLONE_VFORK) and reports exec failures back as the return value
+// Returns 0 or the error number if the child could not be started
+
+int startJob(struct command * command, struct job * job)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    sigset_t noSignals, pipeSignal;
+    char tempPath[PATH_MAX];
+    char ** argv = command->argv;
+    int error, batchFd = -1, inFd = -1;
+
+    if ((error = posix_spawn_file_actions_init(&actions)) != 0)
+        return error;
+
+    // Children must not inherit SIGCHLD being blocked for the adaptive wait or SIGPIPE being ignored
+    sigemptyset(&noSignals);
+    sigemptyset(&pipeSignal);
+    sigaddset(&pipeSignal, SIGPIPE);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigmask(&attributes, &noSignals);
+    posix_spawnattr_setsigdefault(&attributes, &pipeSignal);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    if (command->suffix == NULL)
+        argv[command->argc] = job->path;
+    else
+    {
+        argv[command->argc] = NULL;
+
+        if (job->outPath == NULL)
+        {
+            size_t len = strlen(job->path) + strlen(command->suffix) + 1;
+
+            if ((job->outPath = malloc(len)) == NULL)
+            {
+                posix_spawn_file_actions_destroy(&actions);
+                posix_spawnattr_destroy(&attributes);
+
+                return ENOMEM;
+            }
+
+            snprintf(job->outPath, len, "%s%s", job->path, command->suffix);
+        }
+
+        // Compressor streams from the file to its output, parzip never touches the data
+        // Batches come through a pipe that a thread fills with the tar stream
+        if (overwritesInput(job, job->outPath))
+            error = EEXIST;
+        else if (job->batch != NULL)
+            error = (batchFd = startBatch(job->batch)) < 0
+                ? errno : posix_spawn_file_actions_adddup2(&actions, batchFd, STDIN_FILENO);
+        else
+        {
+            // Opened here so the sequential hint is on the file the compressor reads, it doubles the
+            // readahead window of the shared open file
+            inFd = open(job->path, O_RDONLY | O_CLOEXEC);
+            error = inFd < 0 ? errno : posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+
+            if (inFd >= 0)
+                posix_fadvise(inFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+
+        getTempPath(tempPath, sizeof(tempPath), job->outPath);
+
+        if (error == 0)
+            error = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, tempPath,
+                O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
+
+    if (error == 0)
+        error = posix_spawnp(&job->pid, argv[0], &actions, &attributes, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+
+    if (inFd >= 0)
+        close(inFd);
+
+    // Without a reader the batch thread fails its next write and ends, it is joined when the job is
+    if (batchFd >= 0)
+    {
+        close(batchFd);
+
+        if (error != 0)
+            pthread_join(job->batch->thread, NULL);
+    }
+
+    return error;
+}
+
+// Prints how one file ended
+// Returns 1 if compression failed
+
+int reportJob(struct job * job)
+{
+    if (!job->started)
+    {
+        printf("%s: could not start compression: %s\n", job->path, strerror(job->error));
+
+        return 1;
+    }
+
+    if (job->batch != NULL && job->batch->failed && WIFEXITED(job->status) && WEXITSTATUS(job->status) == 0)
+    {
+        printf("%s: tar stream broke off\n", job->path);
+
+        return 1;
+    }
+
+    if (WIFEXITED(job->status) && WEXITSTATUS(job->status) == 0)
+    {
+        printf("%s: ok\n", job->path);
+
+        return 0;
+    }
+
+    if (WIFEXITED(job->status))
+        printf("%s: failed with exit status %d\n", job->path, WEXITSTATUS(job->status));
+    else if (WIFSIGNALED(job->status))
+        printf("%s: killed by signal %d\n", job->path, WTERMSIG(job->status));
+
+    return 1;
+}
+
+// Waits for any child and stores its status in the job it was running
+// With timeoutMs of 0 or more SIGCHLD has to be blocked, it is waited for with sigtimedwait
+// Returns the finished job or NULL if there are no children left or the time ran out
+
+struct job * waitForJob(struct job * jobs, int jobCnt, int timeoutMs)
+{
+    int status = 0;
+    pid_t waitPid;
+    sigset_t childSignal;
+    struct timespec timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000L };
+
+    sigemptyset(&childSignal);
+    sigaddset(&childSignal, SIGCHLD);
+
+    struct rusage usage;
+
+    // wait4 also returns the cpu time the child used for the report
+    while ((waitPid = wait4(-1, &status, timeoutMs < 0 ? 0 : WNOHANG, &usage)) >= 0)
+    {
+        if (waitPid == 0)
+        {
+            if (sigtimedwait(&childSignal, NULL, &timeout) < 0 && errno != EINTR)
+                return NULL;
+
+            continue;
+        }
+
+        for (int i = 0; i < jobCnt; i++)
+        {
+            if (jobs[i].started && jobs[i].pid == waitPid)
+            {
+                jobs[i].status = status;
+                jobs[i].usage = usage;
+
+                return &jobs[i];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Reads the 10 second average of a pressure stall file like /proc/pressure/cpu
+// Returns percentage of time some task was stalled or 0 if the kernel has no pressure information
+
+double readPressure(const char * path)
+{
+    FILE * file = fopen(path, "r");
+    double average = 0;
+
+    if (file == NULL)
+        return 0;
+
+    if (fscanf(file, "some avg10=%lf", &average) != 1)
+        average = 0;
+
+    fclose(file);
+
+    return average;
+}
+
+// Number of cpus the cgroup quota in cpu.max allows, rounded up
+// Returns 0 if there is no limit or no cgroup v2
+
+long getCgroupCpuLimit()
+{
+    char line[PATH_MAX], path[PATH_MAX + 32];
+    long long quota = 0, period = 0;
+    FILE * file = fopen("/proc/self/cgroup", "r");
+
+    if (file == NULL)
+        return 0;
+
+    // cgroup v2 has a single line "0::/path"
+    path[0] = '\0';
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, "0::", 3) == 0)
+        {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", line + 3);
+        }
+    }
+
+    fclose(file);
+
+    if (path[0] == '\0' || (file = fopen(path, "r")) == NULL)
+        return 0;
+
+    // "max 100000" means no quota and does not match
+    if (fscanf(file, "%lld %lld", &quota, &period) != 2 || quota <= 0 || period <= 0)
+        quota = 0;
+
+    fclose(file);
+
+    return quota > 0 ? (long)((quota + period - 1) / period) : 0;
+}
+
+long long getMilliseconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+// Grows or shrinks the number of running compressors by one depending on cpu and io pressure,
+// running ones are never stopped, new ones are just not started above the limit
+// Returns the new limit
+
+long adjustJobLimit(long limit, long maxJobs)
+{
+    double cpu = readPressure("/proc/pressure/cpu");
+    double io = readPressure("/proc/pressure/io");
+
+    if (cpu > PRESSURE_HIGH || io > PRESSURE_HIGH)
+        return limit > 1 ? limit - 1 : 1;
+
+    if (cpu < PRESSURE_LOW && io < PRESSURE_LOW && limit < maxJobs)
+        return limit + 1;
+
+    return limit;
+}
+
+// Lowers cpu and io priority of parzip, children and threads inherit it
+// ioClass is "idle" or a best effort level from 0 to 7, NULL keeps the io priority
+// Returns 0 on success
+
+int setPriority(int niceness, char * ioClass)
+{
+    if (niceness != 0 && setpriority(PRIO_PROCESS, 0, niceness) != 0)
+        return 1;
+
+    if (ioClass == NULL)
+        return 0;
+
+    int priority = strcmp(ioClass, "idle") == 0
+        ? IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT
+        : IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | (ioClass[0] - '0');
+
+    return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, priority) != 0;
+}
+
+long long getTimevalMilliseconds(struct timeval time)
+{
+    return time.tv_sec * 1000LL + time.tv_usec / 1000;
+}
+
+// Opens the report, a tab separated table with one line per file or batch
+// Returns 0 on success
+
+int startProgress(struct progress * progress, int show, char * reportPath, struct job * jobs, int jobCnt)
+{
+    memset(progress, 0, sizeof(struct progress));
+
+    progress->show = show;
+    progress->total = jobCnt;
+    progress->startMs = getMilliseconds();
+
+    for (int i = 0; i < jobCnt; i++)
+        progress->bytesTotal += jobs[i].size;
+
+    if (reportPath == NULL)
+        return 0;
+
+    if ((progress->report = fopen(reportPath, "we")) == NULL)
+        return 1;
+
+    fprintf(progress->report, "path\tin_bytes\tout_bytes\tratio\twall_ms\tuser_ms\tsys_ms\texit\tok\n");
+
+    return 0;
+}
+
+// Prints a progress line at most once per interval unless force is set, bytes of running jobs
+// are counted in live until the jobs finish
+
+void printProgress(struct progress * progress, int force)
+{
+    long long now = getMilliseconds();
+
+    if (!progress->show || (!force && now - progress->lastPrintMs < PROGRESS_INTERVAL_MS))
+        return;
+
+    long long bytesIn = progress->bytesIn + progress->liveIn;
+    double seconds = (now - progress->startMs) / 1000.0;
+    double rate = seconds > 0 ? bytesIn / seconds : 0;
+
+    progress->lastPrintMs = now;
+
+    fprintf(stderr, "[%d/%d] %.1f MB -> %.1f MB, %.1f MB/s", progress->done, progress->total,
+        bytesIn / 1e6, (progress->bytesOut + progress->liveOut) / 1e6, rate / 1e6);
+
+    if (progress->done < progress->total && rate > 0)
+        fprintf(stderr, ", ETA %.0f s", (progress->bytesTotal - bytesIn) / rate);
+
+    fprintf(stderr, "\n");
+}
+
+// Adds a finished job to the counters and the report, exit is 128 plus the signal for killed
+// children like in shells and -1 for jobs that never started, an unknown output size is -1
+// A batch can fail with exit 0 when its tar stream broke off
+
+void recordJob(struct progress * progress, struct job * job, off_t outSize, int exitCode, int failed)
+{
+    progress->done++;
+    progress->bytesIn += job->size;
+    progress->bytesOut += outSize > 0 ? outSize : 0;
+    progress->liveIn = 0;
+    progress->liveOut = 0;
+
+    if (progress->report != NULL)
+    {
+        fprintf(progress->report, "%s\t%lld\t%lld\t", job->path, (long long)job->size, (long long)outSize);
+
+        if (outSize >= 0 && job->size > 0)
+            fprintf(progress->report, "%.4f", (double)outSize / job->size);
+        else
+            fprintf(progress->report, "-");
+
+        fprintf(progress->report, "\t%lld\t%lld\t%lld\t%d\t%d\n", job->wallMs, getTimevalMilliseconds(job->usage.ru_utime),
+            getTimevalMilliseconds(job->usage.ru_stime), exitCode, !failed);
+    }
+
+    // The last job always prints so the final totals are visible
+    printProgress(progress, progress->done == progress->total);
+}
+
+// Sums what the running children read and wrote so far from /proc/pid/io, a compressor reads
+// about its input and writes about its output, so this stands in for the bytes of running jobs
+
+void sampleRunningJobs(struct progress * progress, struct job * jobs, int jobCnt)
+{
+    char path[64], line[128];
+
+    progress->liveIn = 0;
+    progress->liveOut = 0;
+
+    for (int i = 0; i < jobCnt; i++)
+    {
+        if (!jobs[i].started || jobs[i].pid == 0)
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/%d/io", (int)jobs[i].pid);
+
+        FILE * file = fopen(path, "r");
+        long long value;
+
+        if (file == NULL)
+            continue;
+
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            if (sscanf(line, "rchar: %lld", &value) == 1)
+                progress->liveIn += value < jobs[i].size ? value : jobs[i].size;
+            else if (sscanf(line, "wchar: %lld", &value) == 1)
+                progress->liveOut += value;
+        }
+
+        fclose(file);
+    }
+}
+
+// Size of an output file or -1 if there is none
+
+off_t getOutputSize(const char * path)
+{
+    struct stat info;
+
+    return path != NULL && stat(path, &info) == 0 ? info.st_size : -1;
+}
+
+// Exit code for the report, see recordJob
+
+int getExitCode(struct job * job)
+{
+    if (!job->started)
+        return -1;
+
+    if (WIFSIGNALED(job->status))
+        return 128 + WTERMSIG(job->status);
+
+    return WEXITSTATUS(job->status);
+}
+
+// Record of finished files so reruns skip unchanged ones, every finished file is appended as a
+// line of path, size, mtime in nanoseconds, crc32 of the content and output separated by tabs
+// Later lines win, the file is rewritten without outdated lines at the end of a run
+
+struct manifestEntry
+{
+    char * path;
+    off_t size;
+    long long mtimeNs;
+    unsigned long crc;
+    char * output;
+    long order;
+};
+
+struct manifest
+{
+    char * path;
+    FILE * log;
+    struct manifestEntry * entries;
+    long entryCnt;
+};
+
+int compareEntries(const void * a, const void * b)
+{
+    const struct manifestEntry * first = a;
+    const struct manifestEntry * second = b;
+    int result = strcmp(first->path, second->path);
+
+    if (result != 0)
+        return result;
+
+    return first->order < second->order ? -1 : first->order > second->order;
+}
+
+int compareEntryPath(const void * key, const void * entry)
+{
+    return strcmp(key, ((const struct manifestEntry *)entry)->path);
+}
+
+void freeEntries(struct manifest * manifest)
+{
+    for (long i = 0; i < manifest->entryCnt; i++)
+    {
+        free(manifest->entries[i].path);
+        free(manifest->entries[i].output);
+    }
+
+    free(manifest->entries);
+
+    manifest->entries = NULL;
+    manifest->entryCnt = 0;
+}
+
+// Reads all lines of the manifest and keeps the last one of every path, sorted by path
+// A missing manifest is empty, broken lines from a killed run are ignored
+// Returns 0 on success
+
+int readEntries(struct manifest * manifest)
+{
+    FILE * file = fopen(manifest->path, "r");
+    char * line = NULL;
+    size_t lineCapacity = 0;
+    long capacity = 0, kept = 0;
+
+    if (file == NULL)
+        return errno != ENOENT;
+
+    while (getline(&line, &lineCapacity, file) > 0)
+    {
+        char * fields[5], * cursor = line;
+        int fieldCnt = 0;
+
+        // A line cut off by a kill has no newline
+        if (line[strlen(line) - 1] != '\n')
+            break;
+
+        line[strlen(line) - 1] = '\0';
+
+        while (fieldCnt < 5 && (fields[fieldCnt] = strsep(&cursor, "\t")) != NULL)
+            fieldCnt++;
+
+        if (fieldCnt < 5 || cursor != NULL)
+            continue;
+
+        if (manifest->entryCnt == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 1024;
+
+            struct manifestEntry * entries = realloc(manifest->entries, capacity * sizeof(struct manifestEntry));
+
+            if (entries == NULL)
+                break;
+
+            manifest->entries = entries;
+        }
+
+        struct manifestEntry * entry = &manifest->entries[manifest->entryCnt];
+
+        entry->path = strdup(fields[0]);
+        entry->size = strtoll(fields[1], NULL, 10);
+        entry->mtimeNs = strtoll(fields[2], NULL, 10);
+        entry->crc = strtoul(fields[3], NULL, 16);
+        entry->output = strdup(fields[4]);
+        entry->order = manifest->entryCnt++;
+
+        if (entry->path == NULL || entry->output == NULL)
+            break;
+    }
+
+    free(line);
+    fclose(file);
+
+    if (manifest->entryCnt > 0)
+        qsort(manifest->entries, manifest->entryCnt, sizeof(struct manifestEntry), compareEntries);
+
+    for (long i = 0; i < manifest->entryCnt; i++)
+    {
+        if (i + 1 < manifest->entryCnt && strcmp(manifest->entries[i].path, manifest->entries[i + 1].path) == 0)
+        {
+            free(manifest->entries[i].path);
+            free(manifest->entries[i].output);
+        }
+        else
+            manifest->entries[kept++] = manifest->entries[i];
+    }
+
+    manifest->entryCnt = kept;
+
+    return 0;
+}
+
+// Loads the manifest and opens it to append finished files
+// Returns 0 on success
+
+int loadManifest(struct manifest * manifest, char * path)
+{
+    memset(manifest, 0, sizeof(struct manifest));
+
+    manifest->path = path;
+
+    if (readEntries(manifest))
+        return 1;
+
+    return (manifest->log = fopen(path, "ae")) == NULL;
+}
+
+// Rewrites the manifest with only the newest line of every path, through a temporary file
+// Returns 0 on success
+
+int closeManifest(struct manifest * manifest)
+{
+    char tempPath[PATH_MAX];
+    int failed = fclose(manifest->log) != 0;
+
+    freeEntries(manifest);
+    failed = failed || readEntries(manifest);
+
+    getTempPath(tempPath, sizeof(tempPath), manifest->path);
+
+    FILE * file = failed ? NULL : fopen(tempPath, "w");
+
+    for (long i = 0; file != NULL && i < manifest->entryCnt; i++)
+    {
+        struct manifestEntry * entry = &manifest->entries[i];
+
+        fprintf(file, "%s\t%lld\t%lld\t%08lx\t%s\n", entry->path, (long long)entry->size, entry->mtimeNs, entry->crc, entry->output);
+    }
+
+    if (file == NULL || fclose(file) != 0 || rename(tempPath, manifest->path) != 0)
+        failed = 1;
+
+    freeEntries(manifest);
+
+    return failed;
+}
+
+// crc32 of a whole file
+// Returns 0 on success
+
+int hashFile(const char * path, unsigned long * crc)
+{
+    unsigned char * buffer = malloc(TAR_COPY_BUFFER);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t got = -1;
+
+    *crc = crc32(0, NULL, 0);
+
+    while (buffer != NULL && fd >= 0 && (got = read(fd, buffer, TAR_COPY_BUFFER)) > 0)
+        *crc = crc32(*crc, buffer, got);
+
+    if (fd >= 0)
+        close(fd);
+
+    free(buffer);
+
+    return got != 0;
+}
+
+long long getMtimeNs(struct stat * info)
+{
+    return info->st_mtim.tv_sec * 1000000000LL + info->st_mtim.tv_nsec;
+}
+
+// Appends a line for a file that was compressed into output, output is "-" if unknown
+// Files that changed since the job was created are left out so the next run does them again
+// The crc comes from the engine or batch thread that read the file, only files a separate
+// program read are hashed here
+
+void manifestAddFile(struct manifest * manifest, struct job * file, const char * output)
+{
+    struct stat info;
+
+    if (manifest == NULL || strpbrk(file->path, "\t\n") != NULL || stat(file->path, &info) != 0
+        || info.st_size != file->size || getMtimeNs(&info) != file->mtimeNs)
+        return;
+
+    if (!file->hashed && hashFile(file->path, &file->crc))
+        return;
+
+    file->hashed = 1;
+
+    fprintf(manifest->log, "%s\t%lld\t%lld\t%08lx\t%s\n", file->path, (long long)file->size, file->mtimeNs, file->crc, output);
+
+    // Every line is out before the next job ends, so a killed run loses nothing it finished
+    fflush(manifest->log);
+}
+
+// Records a finished job, a batch records each of its files that made it in with the batch as output
+
+void manifestAddJob(struct manifest * manifest, struct job * job)
+{
+    if (job->batch == NULL)
+    {
+        manifestAddFile(manifest, job, job->outPath != NULL ? job->outPath : "-");
+
+        return;
+    }
+
+    for (int i = 0; i < job->batch->fileCnt; i++)
+    {
+        if (job->batch->files[i].error == 0)
+            manifestAddFile(manifest, &job->batch->files[i], job->outPath);
+    }
+}
+
+// Checks if a recorded output is the one this run would write, suffix is NULL for programs that
+// name their output themselves and batched files may be in any batch with the same suffix
+
+int isSameOutput(const char * recorded, const char * path, const char * suffix, int batched)
+{
+    size_t recordedLen = strlen(recorded), pathLen = strlen(path);
+
+    if (suffix == NULL)
+        return strcmp(recorded, "-") == 0;
+
+    size_t suffixLen = strlen(suffix);
+
+    if (batched)
+        return strncmp(recorded, "batch-", 6) == 0 && recordedLen >= 10 + suffixLen
+            && strncmp(recorded + recordedLen - suffixLen - 4, ".tar", 4) == 0
+            && strcmp(recorded + recordedLen - suffixLen, suffix) == 0;
+
+    return recordedLen == pathLen + suffixLen && strncmp(recorded, path, pathLen) == 0
+        && strcmp(recorded + pathLen, suffix) == 0;
+}
+
+// Checks if a file is still the same as when it was compressed into the output this run would
+// write and that output is still there, a file with only a new mtime is hashed and recorded
+// again if the content is the same
+
+int isUnchanged(struct manifest * manifest, struct job * job, const char * suffix, int batched)
+{
+    if (manifest->entryCnt == 0)
+        return 0;
+
+    struct manifestEntry * entry = bsearch(job->path, manifest->entries, manifest->entryCnt,
+        sizeof(struct manifestEntry), compareEntryPath);
+
+    if (entry == NULL || entry->size != job->size || !isSameOutput(entry->output, job->path, suffix, batched)
+        || (strcmp(entry->output, "-") != 0 && access(entry->output, F_OK) != 0))
+        return 0;
+
+    if (entry->mtimeNs == job->mtimeNs)
+        return 1;
+
+    if (hashFile(job->path, &job->crc) || job->crc != entry->crc)
+        return 0;
+
+    job->hashed = 1;
+
+    manifestAddFile(manifest, job, entry->output);
+
+    return 1;
+}
+
+// Built in compression engine, one file is split into blocks that are compressed on a pool of
+// threads, every block becomes its own gzip member or zstd frame so the output is a normal
+// stream that any gzip or zstd can read
+// The main thread reads blocks ahead into a ring and writes finished ones in order
+// The same ring decompresses blocks of seekable files when decompress is set
+
+#define BLOCK_EMPTY 0
+#define BLOCK_FILLED 1
+#define BLOCK_DONE 2
+
+struct block
+{
+    unsigned char * in;
+    size_t inLen;
+    unsigned char * out;
+    size_t outLen;
+    int state;
+    int failed;
+};
+
+struct engine
+{
+    struct block * blocks;
+    int blockCnt;
+    size_t blockSize;
+    size_t inCapacity;
+    size_t outCapacity;
+    int format;
+    int level;
+    int decompress;
+    int seekable;
+    size_t * blockLens;
+    long blockLensCapacity;
+    int threadCnt;
+    pthread_t * threads;
+    long readSeq;
+    long processSeq;
+    long writeSeq;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Compresses one block into a complete gzip member or zstd frame, or decompresses one back
+// Returns 0 on success
+
+int processBlock(struct engine * engine, void * context, struct block * block)
+{
+#ifdef HAVE_ZSTD
+    if (engine->format == FORMAT_ZSTD)
+    {
+        size_t len = engine->decompress
+            ? ZSTD_decompressDCtx(context, block->out, engine->outCapacity, block->in, block->inLen)
+            : ZSTD_compressCCtx(context, block->out, engine->outCapacity, block->in, block->inLen, engine->level);
+
+        if (ZSTD_isError(len))
+            return 1;
+
+        block->outLen = len;
+
+        return 0;
+    }
+#endif
+
+    z_stream * stream = context;
+
+    if ((engine->decompress ? inflateReset(stream) : deflateReset(stream)) != Z_OK)
+        return 1;
+
+    stream->next_in = block->in;
+    stream->avail_in = block->inLen;
+    stream->next_out = block->out;
+    stream->avail_out = engine->outCapacity;
+
+    if ((engine->decompress ? inflate(stream, Z_FINISH) : deflate(stream, Z_FINISH)) != Z_STREAM_END)
+        return 1;
+
+    block->outLen = engine->outCapacity - stream->avail_out;
+
+    return 0;
+}
+
+void * engineThread(void * args)
+{
+    struct engine * engine = args;
+    void * context = NULL;
+    z_stream stream;
+
+#ifdef HAVE_ZSTD
+    if (engine->format == FORMAT_ZSTD)
+        context = engine->decompress ? (void *)ZSTD_createDCtx() : (void *)ZSTD_createCCtx();
+#endif
+
+    if (engine->format == FORMAT_GZIP)
+    {
+        memset(&stream, 0, sizeof(stream));
+
+        // 16 added to window bits asks for a gzip header and trailer
+        if (engine->decompress ? inflateInit2(&stream, 15 + 16) == Z_OK
+            : deflateInit2(&stream, engine->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+            context = &stream;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+
+    while (1)
+    {
+        while (!engine->stop && engine->processSeq == engine->readSeq)
+            pthread_cond_wait(&engine->cond, &engine->lock);
+
+        if (engine->processSeq == engine->readSeq)
+            break;
+
+        struct block * block = &engine->blocks[engine->processSeq++ % engine->blockCnt];
+
+        pthread_mutex_unlock(&engine->lock);
+
+        int failed = context == NULL || processBlock(engine, context, block);
+
+        pthread_mutex_lock(&engine->lock);
+
+        block->failed = failed;
+        block->state = BLOCK_DONE;
+
+        pthread_cond_broadcast(&engine->cond);
+    }
+
+    pthread_mutex_unlock(&engine->lock);
+
+#ifdef HAVE_ZSTD
+    if (engine->format == FORMAT_ZSTD && engine->decompress)
+        ZSTD_freeDCtx(context);
+    else if (engine->format == FORMAT_ZSTD)
+        ZSTD_freeCCtx(context);
+#endif
+
+    if (engine->format == FORMAT_GZIP && context != NULL)
+    {
+        if (engine->decompress)
+            inflateEnd(&stream);
+        else
+            deflateEnd(&stream);
+    }
+
+    return NULL;
+}
+
+// Largest possible size of one compressed block
+
+size_t blockBound(struct engine * engine)
+{
+#ifdef HAVE_ZSTD
+    if (engine->format == FORMAT_ZSTD)
+        return ZSTD_compressBound(engine->blockSize);
+#endif
+
+    z_stream stream;
+    size_t bound = 0;
+
+    memset(&stream, 0, sizeof(stream));
+
+    if (deflateInit2(&stream, engine->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+    {
+        bound = deflateBound(&stream, engine->blockSize);
+
+        deflateEnd(&stream);
+    }
+
+    return bound;
+}
+
+// Allocates blocks and starts the compression or decompression threads
+// Returns 0 on success
+
+int startEngine(struct engine * engine, int format, int level, size_t blockSize, int threadCnt, int decompress)
+{
+    memset(engine, 0, sizeof(struct engine));
+
+    engine->format = format;
+    engine->level = level;
+    engine->blockSize = blockSize;
+    engine->threadCnt = threadCnt;
+    engine->decompress = decompress;
+
+    // The bound does not depend on the level, so it also holds for blocks read back
+    engine->inCapacity = decompress ? blockBound(engine) : blockSize;
+    engine->outCapacity = decompress ? blockSize : blockBound(engine);
+
+    // Twice as many blocks as threads so reading and writing can go on while all threads work
+    engine->blockCnt = 2 * threadCnt;
+    engine->blocks = calloc(engine->blockCnt, sizeof(struct block));
+    engine->threads = calloc(threadCnt, sizeof(pthread_t));
+
+    if (engine->inCapacity == 0 || engine->outCapacity == 0 || engine->blocks == NULL || engine->threads == NULL)
+        return 1;
+
+    for (int i = 0; i < engine->blockCnt; i++)
+    {
+        engine->blocks[i].in = malloc(engine->inCapacity);
+        engine->blocks[i].out = malloc(engine->outCapacity);
+
+        if (engine->blocks[i].in == NULL || engine->blocks[i].out == NULL)
+            return 1;
+    }
+
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->cond, NULL);
+
+    for (int i = 0; i < threadCnt; i++)
+    {
+        if (pthread_create(&engine->threads[i], NULL, engineThread, engine))
+        {
+            engine->threadCnt = i;
+
+            return i == 0;
+        }
+    }
+
+    return 0;
+}
+
+void stopEngine(struct engine * engine)
+{
+    if (engine->threads != NULL)
+    {
+        pthread_mutex_lock(&engine->lock);
+        engine->stop = 1;
+        pthread_cond_broadcast(&engine->cond);
+        pthread_mutex_unlock(&engine->lock);
+
+        for (int i = 0; i < engine->threadCnt; i++)
+            pthread_join(engine->threads[i], NULL);
+    }
+
+    for (int i = 0; engine->blocks != NULL && i < engine->blockCnt; i++)
+    {
+        free(engine->blocks[i].in);
+        free(engine->blocks[i].out);
+    }
+
+    free(engine->blocks);
+    free(engine->threads);
+    free(engine->blockLens);
+}
+
+// Remembers the compressed size of one block for the seekable index
+// Returns 1 when out of memory
+
+int addBlockLen(struct engine * engine, long index, size_t len)
+{
+    if (index >= engine->blockLensCapacity)
+    {
+        long capacity = engine->blockLensCapacity ? 2 * engine->blockLensCapacity : 1024;
+        size_t * lens = realloc(engine->blockLens, capacity * sizeof(size_t));
+
+        if (lens == NULL)
+            return 1;
+
+        engine->blockLens = lens;
+        engine->blockLensCapacity = capacity;
+    }
+
+    engine->blockLens[index] = len;
+
+    return 0;
+}
+
+// Writes the index after the last block, the index ends with its own length so readers find
+// it from the end of the file
+// Returns 1 on failure
+
+int writeIndex(struct engine * engine, int fd, long blockCnt, unsigned long long totalSize)
+{
+    int gzip = engine->format == FORMAT_GZIP;
+    size_t headLen = gzip ? 10 : 8;
+    char * index = malloc(headLen + 64 + (blockCnt + 1) * (2 * sizeof(size_t) + 1) + INDEX_LEN_DIGITS + GZIP_INDEX_TAIL);
+
+    if (index == NULL)
+        return 1;
+
+    size_t len = headLen + sprintf(index + headLen, "%s %zu %llu %ld", INDEX_MAGIC, engine->blockSize, totalSize, blockCnt);
+
+    for (long i = 0; i < blockCnt; i++)
+        len += sprintf(index + len, " %zx", engine->blockLens[i]);
+
+    size_t total = len + 1 + INDEX_LEN_DIGITS + (gzip ? GZIP_INDEX_TAIL : 0);
+
+    // The terminating zero of the length ends the gzip comment
+    sprintf(index + len, " %0*zx", INDEX_LEN_DIGITS, total);
+
+    if (gzip)
+    {
+        // Member with only the comment flag set, unix as system
+        const unsigned char head[10] = { 0x1f, 0x8b, 8, 0x10, 0, 0, 0, 0, 0, 3 };
+
+        memcpy(index, head, sizeof(head));
+
+        // Empty final deflate block followed by crc and size of nothing
+        memset(index + total - GZIP_INDEX_TAIL + 1, 0, GZIP_INDEX_TAIL - 1);
+        index[total - GZIP_INDEX_TAIL + 1] = 3;
+    }
+    else
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            index[i] = (ZSTD_SKIPPABLE_MAGIC >> (8 * i)) & 0xff;
+            index[4 + i] = ((total - 8) >> (8 * i)) & 0xff;
+        }
+    }
+
+    int failed = writeFull(fd, (unsigned char *)index, total);
+
+    free(index);
+
+    return failed;
+}
+
+// Compresses everything read from in into outPath, crc gets the crc32 of the input if set
+// Written blocks count as live progress until the file is recorded
+// Returns 0 on success, errors are printed with the name
+
+int compressStream(struct engine * engine, int in, char * name, char * outPath, unsigned long * crc,
+    struct progress * progress)
+{
+    char tempPath[PATH_MAX];
+
+    getTempPath(tempPath, sizeof(tempPath), outPath);
+
+    int out = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    if (out < 0)
+    {
+        printf("%s: could not create %s\n", name, tempPath);
+
+        return 1;
+    }
+
+    int eof = 0, readFailed = 0, failed = 0, first = 1;
+    long blockIndex = 0;
+    unsigned long long totalSize = 0;
+
+    if (crc != NULL)
+        *crc = crc32(0, NULL, 0);
+
+    while (1)
+    {
+        // Fill every free block, an empty file still gets one empty member
+        while (!eof && engine->readSeq - engine->writeSeq < engine->blockCnt)
+        {
+            struct block * block = &engine->blocks[engine->readSeq % engine->blockCnt];
+            ssize_t got = readFull(in, block->in, engine->blockSize);
+
+            if (got < 0)
+                readFailed = 1;
+
+            if (got < 0 || (got == 0 && !first))
+            {
+                eof = 1;
+
+                break;
+            }
+
+            block->inLen = got;
+            block->state = BLOCK_FILLED;
+            first = 0;
+            eof = (size_t)got < engine->blockSize;
+
+            pthread_mutex_lock(&engine->lock);
+            engine->readSeq++;
+            pthread_cond_broadcast(&engine->cond);
+            pthread_mutex_unlock(&engine->lock);
+        }
+
+        if (engine->writeSeq == engine->readSeq)
+            break;
+
+        // Blocks are written strictly in order
+        struct block * block = &engine->blocks[engine->writeSeq % engine->blockCnt];
+
+        pthread_mutex_lock(&engine->lock);
+
+        while (block->state != BLOCK_DONE)
+            pthread_cond_wait(&engine->cond, &engine->lock);
+
+        pthread_mutex_unlock(&engine->lock);
+
+        if (!failed)
+            failed = block->failed || writeFull(out, block->out, block->outLen);
+
+        if (!failed && engine->seekable)
+            failed = addBlockLen(engine, blockIndex++, block->outLen);
+
+        // Hashed while the threads work on the blocks behind this one
+        if (crc != NULL)
+            *crc = crc32(*crc, block->in, block->inLen);
+
+        totalSize += block->inLen;
+        progress->liveIn += block->inLen;
+        progress->liveOut += block->outLen;
+        printProgress(progress, 0);
+
+        block->state = BLOCK_EMPTY;
+        engine->writeSeq++;
+    }
+
+    if (!failed && !readFailed && engine->seekable)
+        failed = writeIndex(engine, out, blockIndex, totalSize);
+
+    if (close(out) != 0)
+        failed = 1;
+
+    if (readFailed || failed)
+        printf("%s: %s failed\n", name, readFailed ? "reading" : "compression");
+
+    return finishOutput(outPath, readFailed || failed);
+}
+
+// Compresses one file into path with .gz or .zst added, the original file is kept, or a batch
+// of small files into its tar output
+// Returns the number of files that failed, errors are printed with the file name
+
+int compressFile(struct engine * engine, struct job * job, struct progress * progress, struct manifest * manifest)
+{
+    char outPath[PATH_MAX];
+    struct rusage before, after;
+
+    // All threads work for this file, so the process usage difference is its cpu time
+    getrusage(RUSAGE_SELF, &before);
+    job->startMs = getMilliseconds();
+
+    if (job->batch == NULL)
+        snprintf(outPath, sizeof(outPath), "%s%s", job->path, engine->format == FORMAT_ZSTD ? ".zst" : ".gz");
+
+    if (overwritesInput(job, job->batch != NULL ? job->outPath : outPath))
+    {
+        printf("%s: output would replace an input\n", job->path);
+
+        recordJob(progress, job, -1, 1, 1);
+
+        return 1;
+    }
+
+    int in = job->batch != NULL ? startBatch(job->batch) : open(job->path, O_RDONLY | O_CLOEXEC);
+
+    if (in < 0)
+    {
+        printf("%s: could not open file\n", job->path);
+
+        recordJob(progress, job, -1, 1, 1);
+
+        return 1;
+    }
+
+    if (job->batch == NULL)
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int failed = compressStream(engine, in, job->path, job->batch != NULL ? job->outPath : outPath,
+        manifest != NULL && job->batch == NULL ? &job->crc : NULL, progress);
+
+    close(in);
+
+    if (job->batch != NULL)
+    {
+        pthread_join(job->batch->thread, NULL);
+
+        // The output already has its name when the tar stream ended early without a read error
+        if (!failed && job->batch->failed)
+        {
+            printf("%s: tar stream broke off\n", job->path);
+
+            unlink(job->outPath);
+
+            failed = 1;
+        }
+    }
+
+    if (!failed)
+    {
+        printf("%s: ok\n", job->path);
+
+        if (job->batch == NULL)
+        {
+            job->hashed = manifest != NULL;
+
+            manifestAddFile(manifest, job, outPath);
+        }
+        else
+            manifestAddJob(manifest, job);
+    }
+
+    getrusage(RUSAGE_SELF, &after);
+
+    job->wallMs = getMilliseconds() - job->startMs;
+    timersub(&after.ru_utime, &before.ru_utime, &job->usage.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &job->usage.ru_stime);
+
+    recordJob(progress, job, failed ? -1 : getOutputSize(job->batch != NULL ? job->outPath : outPath), failed, failed);
+
+    return failed || job->batch == NULL ? failed : job->batch->badFiles;
+}
+
+// Compresses all files one after another, each with all threads
+// Returns number of files that failed
+
+int compressFiles(struct job * jobs, int jobCnt, int format, int level, size_t blockSize, int threadCnt, int seekable,
+    struct progress * progress, struct manifest * manifest)
+{
+    struct engine engine;
+    int failed = 0;
+
+    if (startEngine(&engine, format, level, blockSize, threadCnt, 0))
+    {
+        printf("Could not start compression threads!\n");
+
+        stopEngine(&engine);
+
+        return jobCnt;
+    }
+
+    engine.seekable = seekable;
+
+    for (int i = 0; i < jobCnt; i++)
+    {
+        // The next file is read in while this one is compressed
+        if (i + 1 < jobCnt && jobs[i + 1].batch == NULL)
+            prefetchFile(jobs[i + 1].path);
+
+        failed += compressFile(&engine, &jobs[i], progress, manifest);
+    }
+
+    stopEngine(&engine);
+
+    return failed;
+}
+
+// Block layout of a seekable file read back from its index
+
+struct seekIndex
+{
+    int format;
+    size_t blockSize;
+    unsigned long long totalSize;
+    long blockCnt;
+    off_t * offsets;
+};
+
+// Reads exactly len bytes at offset, returns 1 on failure
+
+int preadFull(int fd, void * buffer, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t got = pread(fd, buffer, len, offset);
+
+        if (got <= 0)
+            return 1;
+
+        buffer = (char *)buffer + got;
+        len -= got;
+        offset += got;
+    }
+
+    return 0;
+}
+
+// Finds the index at the end of a seekable file and turns block sizes into offsets
+// Returns 0 on success
+
+int readIndex(int fd, off_t fileSize, struct seekIndex * index)
+{
+    unsigned char magic[4];
+    char digits[INDEX_LEN_DIGITS + 1] = { 0 };
+
+    memset(index, 0, sizeof(struct seekIndex));
+
+    if (fileSize < 4 || preadFull(fd, magic, 4, 0))
+        return 1;
+
+    if (magic[0] == 0x1f && magic[1] == 0x8b)
+        index->format = FORMAT_GZIP;
+    else if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        index->format = FORMAT_ZSTD;
+    else
+        return 1;
+
+    int gzip = index->format == FORMAT_GZIP;
+    off_t tailLen = INDEX_LEN_DIGITS + (gzip ? GZIP_INDEX_TAIL : 0);
+
+    if (fileSize < tailLen || preadFull(fd, digits, INDEX_LEN_DIGITS, fileSize - tailLen))
+        return 1;
+
+    char * end;
+    unsigned long long total = strtoull(digits, &end, 16);
+    size_t headLen = gzip ? 10 : 8;
+
+    if (*end != '\0' || total < headLen + tailLen || total > (unsigned long long)fileSize)
+        return 1;
+
+    char * text = malloc(total + 1);
+
+    if (text == NULL || preadFull(fd, text, total, fileSize - total))
+    {
+        free(text);
+
+        return 1;
+    }
+
+    text[total - tailLen] = '\0';
+
+    char * cursor = text + headLen;
+    size_t magicLen = strlen(INDEX_MAGIC);
+    int failed = strncmp(cursor, INDEX_MAGIC, magicLen) != 0;
+
+    if (!failed)
+    {
+        cursor += magicLen;
+        index->blockSize = strtoull(cursor, &cursor, 10);
+        index->totalSize = strtoull(cursor, &cursor, 10);
+        index->blockCnt = strtol(cursor, &cursor, 10);
+
+        // Every block but the last is full and an empty file still has one block
+        failed = index->blockSize == 0 || index->blockCnt > fileSize || (unsigned long long)index->blockCnt
+            != (index->totalSize == 0 ? 1 : (index->totalSize + index->blockSize - 1) / index->blockSize);
+    }
+
+    if (!failed)
+        index->offsets = malloc((index->blockCnt + 1) * sizeof(off_t));
+
+    failed = failed || index->offsets == NULL;
+
+    if (!failed)
+        index->offsets[0] = 0;
+
+    for (long i = 0; !failed && i < index->blockCnt; i++)
+    {
+        index->offsets[i + 1] = index->offsets[i] + strtoull(cursor, &end, 16);
+        failed = end == cursor || index->offsets[i + 1] <= index->offsets[i];
+        cursor = end;
+    }
+
+    // Blocks have to fill the file exactly up to the index
+    failed = failed || index->offsets[index->blockCnt] != fileSize - (off_t)total;
+
+    free(text);
+
+    return failed;
+}
+
+// Decompresses length bytes from offset of a seekable file to standard output, blocks are
+// decompressed on threadCnt threads, a negative offset counts from the end
+// Returns 0 on success, errors go to standard error since output carries the data
+
+int extractFile(char * path, long long offset, unsigned long long length, int threadCnt)
+{
+    struct seekIndex index;
+    struct engine engine;
+    struct stat info;
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (in < 0 || fstat(in, &info) != 0)
+    {
+        fprintf(stderr, "%s: could not open file\n", path);
+
+        if (in >= 0)
+            close(in);
+
+        return 1;
+    }
+
+    index.offsets = NULL;
+
+    if (readIndex(in, info.st_size, &index))
+    {
+        fprintf(stderr, "%s: not a seekable file\n", path);
+
+        free(index.offsets);
+        close(in);
+
+        return 1;
+    }
+
+    unsigned long long start = offset < 0
+        ? (unsigned long long)-offset > index.totalSize ? 0 : index.totalSize + offset
+        : (unsigned long long)offset;
+    unsigned long long end = start + length < start || start + length > index.totalSize
+        ? index.totalSize : start + length;
+
+    if (start >= end)
+    {
+        free(index.offsets);
+        close(in);
+
+        return 0;
+    }
+
+    if (startEngine(&engine, index.format, Z_DEFAULT_COMPRESSION, index.blockSize, threadCnt, 1))
+    {
+        fprintf(stderr, "Could not start decompression threads!\n");
+
+        stopEngine(&engine);
+        free(index.offsets);
+        close(in);
+
+        return 1;
+    }
+
+    long next = start / index.blockSize, last = (end - 1) / index.blockSize;
+    int failed = 0;
+
+    while (1)
+    {
+        // Read compressed blocks ahead while there is room in the ring
+        while (!failed && next <= last && engine.readSeq - engine.writeSeq < engine.blockCnt)
+        {
+            struct block * block = &engine.blocks[engine.readSeq % engine.blockCnt];
+
+            block->inLen = index.offsets[next + 1] - index.offsets[next];
+
+            if (block->inLen > engine.inCapacity || preadFull(in, block->in, block->inLen, index.offsets[next]))
+            {
+                failed = 1;
+
+                break;
+            }
+
+            block->state = BLOCK_FILLED;
+            next++;
+
+            pthread_mutex_lock(&engine.lock);
+            engine.readSeq++;
+            pthread_cond_broadcast(&engine.cond);
+            pthread_mutex_unlock(&engine.lock);
+        }
+
+        if (engine.writeSeq == engine.readSeq)
+            break;
+
+        // Blocks go out in order with the parts outside of the range cut off
+        struct block * block = &engine.blocks[engine.writeSeq % engine.blockCnt];
+        unsigned long long blockStart = (next - (engine.readSeq - engine.writeSeq)) * index.blockSize;
+
+        pthread_mutex_lock(&engine.lock);
+
+        while (block->state != BLOCK_DONE)
+            pthread_cond_wait(&engine.cond, &engine.lock);
+
+        pthread_mutex_unlock(&engine.lock);
+
+        size_t expected = index.totalSize - blockStart < index.blockSize ? index.totalSize - blockStart : index.blockSize;
+        size_t from = start > blockStart ? start - blockStart : 0;
+        size_t to = end - blockStart < expected ? end - blockStart : expected;
+
+        if (!failed)
+            failed = block->failed || block->outLen != expected || writeFull(STDOUT_FILENO, block->out + from, to - from);
+
+        block->state = BLOCK_EMPTY;
+        engine.writeSeq++;
+    }
+
+    if (failed)
+        fprintf(stderr, "%s: decompression failed\n", path);
+
+    stopEngine(&engine);
+    free(index.offsets);
+    close(in);
+
+    return failed;
+}
+
+// Usage: parzip [-j jobs] [-o suffix] "program [arguments]" file...
+//        parzip [-j threads] [-l level] [-b blockKB] [-S] -z gzip|zstd file...
+//        either one with [-B thresholdKB] to pack smaller files into batch-N.tar archives
+//        parzip [-j threads] -x file [offset [length]]
+// At most jobs compressions run at once, default is the number of online processors
+// -o gives each file to the program on standard input and writes its output to file with suffix
+// -a adapts the number of running jobs to cpu and io pressure, jobs is then the upper bound
+// -n niceness and -I idle|0-7 lower the priority of parzip and everything it starts
+// -z compresses in this process instead, every file is split into blocks compressed by threads
+// -S adds an index so -x can decompress any byte range of the file without starting at the front
+// -M keeps a manifest of compressed files, a rerun with the same manifest skips files that did
+// not change and an interrupted run continues with the files it had not finished
+// -P prints progress to standard error, -R writes a tab separated report with a line per file
+// -B feeds files below the threshold as tar streams to one compressor per batch, this needs -o
+// when running a program, large files still get their own jobs
+
+int main(int argc, char ** argv)
+{
+    long maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+    long cgroupLimit = getCgroupCpuLimit();
+    int format = -1, level = -1, seekable = 0, extract = 0, adaptive = 0, niceness = 0, option;
+    off_t batchThreshold = 0;
+    int showProgress = 0;
+    char * reportPath = NULL;
+    char * manifestPath = NULL;
+    struct progress progress;
+    struct manifest manifest;
+    char * ioClass = NULL;
+
+    // A cpu quota caps the default, more compressors than allowed cpus only get throttled
+    if (cgroupLimit > 0 && cgroupLimit < maxJobs)
+        maxJobs = cgroupLimit;
+
+    struct command command = { NULL, 0, NULL };
+    size_t blockSize = DEFAULT_BLOCK_SIZE;
+
+    // Options end at the program name so its own arguments are left alone
+    while ((option = getopt(argc, argv, "+j:z:l:b:Sxo:an:I:B:PR:M:")) != -1)
+    {
+        switch (option)
+        {
+        case 'j':
+            maxJobs = atol(optarg);
+            break;
+
+        case 'l':
+            level = atoi(optarg);
+            break;
+
+        case 'b':
+            blockSize = (size_t)atol(optarg) * 1024;
+            break;
+
+        case 'S':
+            seekable = 1;
+            break;
+
+        case 'x':
+            extract = 1;
+            break;
+
+        case 'o':
+            // Without a suffix the output would be renamed over the input
+            if (optarg[0] == '\0')
+            {
+                printf("Output suffix must not be empty!\n");
+
+                return 1;
+            }
+
+            command.suffix = optarg;
+            break;
+
+        case 'a':
+            adaptive = 1;
+            break;
+
+        case 'n':
+            niceness = atoi(optarg);
+            break;
+
+        case 'I':
+            // Anything else would fall back to level 0, the highest best effort priority
+            if (strcmp(optarg, "idle") != 0 && (optarg[0] < '0' || optarg[0] > '7' || optarg[1] != '\0'))
+            {
+                printf("IO priority must be idle or 0-7!\n");
+
+                return 1;
+            }
+
+            ioClass = optarg;
+            break;
+
+        case 'B':
+            batchThreshold = (off_t)atol(optarg) * 1024;
+            break;
+
+        case 'P':
+            showProgress = 1;
+            break;
+
+        case 'R':
+            reportPath = optarg;
+            break;
+
+        case 'M':
+            manifestPath = optarg;
+            break;
+
+        case 'z':
+            if (strcmp(optarg, "gzip") == 0)
+                format = FORMAT_GZIP;
+#ifdef HAVE_ZSTD
+            else if (strcmp(optarg, "zstd") == 0)
+                format = FORMAT_ZSTD;
+#endif
+            else
+            {
+                printf("Unsupported format %s!\n", optarg);
+
+                return 1;
+            }
+            break;
+
+        default:
+            return 1;
+        }
+    }
+
+    int argIndex = optind;
+
+    if (maxJobs < 1)
+        maxJobs = 1;
+
+    if (setPriority(niceness, ioClass))
+        fprintf(stderr, "Could not set priority, running with the current one\n");
+
+    if (extract)
+    {
+        if (argc - argIndex < 1 || argc - argIndex > 3)
+        {
+            fprintf(stderr, "Usage: parzip [-j threads] -x file [offset [length]]\n");
+
+            return 1;
+        }
+
+        long long offset = argc - argIndex > 1 ? strtoll(argv[argIndex + 1], NULL, 10) : 0;
+        unsigned long long length = argc - argIndex > 2 ? strtoull(argv[argIndex + 2], NULL, 10) : ~0ULL;
+
+        return extractFile(argv[argIndex], offset, length, (int)maxJobs);
+    }
+
+    // Check if minimum number of arguments was met, if not informs user and returns error code
+    // The built in engine needs no program
+    int fileIndex = argIndex + (format >= 0 ? 0 : 1);
+
+    if(argc - fileIndex < 1)
+    {
+        printf("Not enough arguments!\n");
+
+        return 1;
+    }
+
+    if (batchThreshold > 0 && format < 0 && command.suffix == NULL)
+    {
+        printf("Batches need -o, the tar stream is given to the program on standard input!\n");
+
+        return 1;
+    }
+
+    int jobCnt = argc - fileIndex, running = 0, failed = 0, next = 0, prefetched = 0;
+    struct job * jobs = calloc(jobCnt, sizeof(struct job));
+
+    if (jobs == NULL || (format < 0 && parseCommand(argv[argIndex], &command)))
+    {
+        printf(jobs == NULL ? "Out of memory!\n" : "Missing compression program!\n");
+
+        free(jobs);
+        free(command.argv);
+
+        return 1;
+    }
+
+    if (manifestPath != NULL && loadManifest(&manifest, manifestPath))
+    {
+        printf("Could not open manifest %s!\n", manifestPath);
+
+        free(jobs);
+        free(command.argv);
+
+        return 1;
+    }
+
+    off_t smallTotal = 0;
+    int kept = 0;
+
+    for (int i = 0; i < jobCnt; i++)
+    {
+        struct stat st;
+        struct job * job = &jobs[kept];
+
+        int found = stat(argv[fileIndex + i], &st) == 0;
+
+        job->path = argv[fileIndex + i];
+        job->size = found ? st.st_size : 0;
+        job->mtimeNs = found ? getMtimeNs(&st) : 0;
+        job->hashed = 0;
+
+        if (found && manifestPath != NULL && isUnchanged(&manifest, job,
+            format < 0 ? command.suffix : format == FORMAT_ZSTD ? ".zst" : ".gz", job->size < batchThreshold))
+        {
+            printf("%s: unchanged\n", job->path);
+
+            continue;
+        }
+
+        smallTotal += job->size < batchThreshold ? job->size : 0;
+        kept++;
+    }
+
+    jobCnt = kept;
+
+    if (batchThreshold > 0)
+    {
+        // Separate programs need enough batches to keep all jobs busy, the engine is parallel anyway
+        off_t target = format >= 0 ? BATCH_TARGET : smallTotal / maxJobs + 1;
+
+        if (target > BATCH_TARGET)
+            target = BATCH_TARGET;
+
+        // Batch threads notice a compressor that ended early by a failed write
+        signal(SIGPIPE, SIG_IGN);
+
+        // Batches of earlier runs hold files the manifest still points to
+        jobCnt = groupSmallFiles(jobs, jobCnt, batchThreshold, target,
+            format < 0 ? command.suffix : format == FORMAT_ZSTD ? ".zst" : ".gz", manifestPath != NULL);
+
+        if (jobCnt < 0)
+        {
+            printf("Out of memory!\n");
+
+            free(command.argv);
+
+            return 1;
+        }
+    }
+
+    qsort(jobs, jobCnt, sizeof(struct job), compareJobs);
+
+    if (startProgress(&progress, showProgress, reportPath, jobs, jobCnt))
+    {
+        printf("Could not create report %s!\n", reportPath);
+
+        freeJobs(jobs, jobCnt);
+        free(command.argv);
+
+        return 1;
+    }
+
+    if (format >= 0)
+    {
+        if (blockSize == 0)
+            blockSize = DEFAULT_BLOCK_SIZE;
+
+        if (level < 0)
+            level = format == FORMAT_GZIP ? Z_DEFAULT_COMPRESSION : 3;
+
+        failed = compressFiles(jobs, jobCnt, format, level, blockSize, (int)maxJobs, seekable, &progress,
+            manifestPath != NULL ? &manifest : NULL);
+
+        if (progress.report != NULL && fclose(progress.report) != 0)
+            failed++;
+
+        if (manifestPath != NULL && closeManifest(&manifest))
+            printf("Could not rewrite manifest %s!\n", manifestPath);
+
+        freeJobs(jobs, jobCnt);
+
+        return failed > 0;
+    }
+
+    // Adaptive runs start at half the jobs and wake up every interval to look at the pressure
+    long jobLimit = adaptive ? (maxJobs + 1) / 2 : maxJobs;
+    long long lastCheck = getMilliseconds();
+
+    // Progress lines also come on a timer while long jobs run
+    int waitMs = adaptive ? LOAD_INTERVAL_MS : showProgress ? PROGRESS_INTERVAL_MS : -1;
+
+    if (waitMs >= 0)
+    {
+        sigset_t childSignal;
+
+        sigemptyset(&childSignal);
+        sigaddset(&childSignal, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &childSignal, NULL);
+    }
+
+    // Start jobs until all slots are taken, then refill a slot every time a child exits
+    while (next < jobCnt || running > 0)
+    {
+        if (adaptive && getMilliseconds() - lastCheck >= LOAD_INTERVAL_MS)
+        {
+            jobLimit = adjustJobLimit(jobLimit, maxJobs);
+            lastCheck = getMilliseconds();
+        }
+
+        while (next < jobCnt && running < jobLimit)
+        {
+            jobs[next].error = startJob(&command, &jobs[next]);
+
+            // Spawn can fail if there are too many processes, wait for one of ours to end and try again
+            if (jobs[next].error != 0)
+            {
+                if (running > 0 && jobs[next].error == EAGAIN)
+                    break;
+
+                failed += reportJob(&jobs[next]);
+                recordJob(&progress, &jobs[next++], -1, -1, 1);
+
+                continue;
+            }
+
+            jobs[next].startMs = getMilliseconds();
+            jobs[next++].started = 1;
+            running++;
+        }
+
+        // Files that start next are read in while the running ones compress, batches prefetch
+        // their own files
+        for (prefetched = prefetched > next ? prefetched : next; prefetched < jobCnt && prefetched < next + jobLimit; prefetched++)
+        {
+            if (jobs[prefetched].batch == NULL)
+                prefetchFile(jobs[prefetched].path);
+        }
+
+        if (running == 0)
+            continue;
+
+        struct job * done = waitForJob(jobs, jobCnt, waitMs);
+
+        if (done == NULL && waitMs >= 0 && errno == EAGAIN)
+        {
+            sampleRunningJobs(&progress, jobs, jobCnt);
+            printProgress(&progress, 0);
+
+            continue;
+        }
+
+        if (done == NULL)
+            break;
+
+        running--;
+        done->pid = 0;
+        done->wallMs = getMilliseconds() - done->startMs;
+
+        if (done->batch != NULL)
+            pthread_join(done->batch->thread, NULL);
+
+        int jobFailed = reportJob(done);
+
+        // Output of a failed compressor is removed, a finished one gets its real name
+        if (done->outPath != NULL)
+            jobFailed = finishOutput(done->outPath, jobFailed);
+
+        if (jobFailed)
+            failed++;
+        else
+        {
+            // The archive is kept without files that could not be read, only those count as failed
+            failed += done->batch != NULL ? done->batch->badFiles : 0;
+
+            if (manifestPath != NULL)
+                manifestAddJob(&manifest, done);
+        }
+
+        // Without -o the program picks the output name, so its size is unknown
+        recordJob(&progress, done, getOutputSize(done->outPath), getExitCode(done), jobFailed);
+    }
+
+    if (progress.report != NULL && fclose(progress.report) != 0)
+        failed++;
+
+    if (manifestPath != NULL && closeManifest(&manifest))
+        printf("Could not rewrite manifest %s!\n", manifestPath);
+
+    freeJobs(jobs, jobCnt);
+    free(command.argv);
+
+    return failed > 0;
+}